@@ -0,0 +1,11 @@
+#!/bin/bash
+if [ ! -f ../t-par ]; then
+        ../make
+fi
+if [ ! -d qcb ]; then
+        mkdir qcb
+fi
+for f in `find ./*.qc`
+do
+  ../t-par -convert -out-format=qcb < $f > qcb/$f.qcb
+done
@@ -0,0 +1,37 @@
+#!/bin/bash
+# Checks that every benchmark survives a trip through the .qcb format:
+#   converting it to .qcb and reading that back, from a file named on the
+#   command line or redirected to standard input, gives the same circuit as
+#   converting it straight to .qc. A circuit with gates on more qubits than
+#   a gate record holds is checked along with them
+cd "$(dirname "$0")"
+if [ ! -f ../t-par ]; then
+        make -C ..
+fi
+tmp=`mktemp`
+wide=`mktemp --suffix=.qc`
+trap "rm -f $tmp $wide" EXIT
+cat > $wide <<EOF
+.v a b c d e f g h
+.i a b c d e
+BEGIN
+T a
+H b
+tof a b c d e
+T a
+foo a b c d e f
+tof a b c d e f g h
+T a
+END
+EOF
+failed=0
+for f in `find ./*.qc` $wide
+do
+  ../t-par -convert -out-format=qcb < $f > $tmp
+  if ! cmp -s <(../t-par -convert < $f) <(../t-par -convert -in-format=qcb $tmp) ||
+     ! cmp -s <(../t-par -convert < $f) <(../t-par -convert -in-format=qcb < $tmp); then
+    echo "$f: round trip through .qcb changed the circuit"
+    failed=1
+  fi
+done
+exit $failed
@@ -5,7 +5,4 @@ fi
 if [ ! -d opt ]; then
         mkdir opt
 fi
-for f in `find ./*.qc`
-do
-  ../t-par < $f > opt/$f.opt
-done
+../t-par -batch . -out-dir opt
@@ -0,0 +1,126 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include <vector>
+#include <type_traits>
+#include "util.h"
+#include "gf2.h"
+
+#ifndef BITVEC
+#define BITVEC
+
+// Fixed-width bit vector of W blocks with the subset of the xor_func
+//   interface used by the linear algebra routines. Lives inline, so a
+//   matrix of them is a single allocation and every operation unrolls
+template <int W>
+struct bitvec {
+  typedef xor_func::block_type block;
+  static const int bits_per_block = xor_func::bits_per_block;
+  static const size_t npos = xor_func::npos;
+
+  block w[W];
+
+  bitvec() { for (int i = 0; i < W; i++) w[i] = 0; }
+
+  bool test(int i) const { return (w[i / bits_per_block] >> (i % bits_per_block)) & 1; }
+  void set(int i)   { w[i / bits_per_block] |=  ((block)1 << (i % bits_per_block)); }
+  void reset(int i) { w[i / bits_per_block] &= ~((block)1 << (i % bits_per_block)); }
+  void flip(int i)  { w[i / bits_per_block] ^=  ((block)1 << (i % bits_per_block)); }
+  void set(int i, bool val) { if (val) set(i); else reset(i); }
+
+  bool none() const {
+    block acc = 0;
+    for (int i = 0; i < W; i++) acc |= w[i];
+    return acc == 0;
+  }
+
+  bool operator==(const bitvec & b) const {
+    for (int i = 0; i < W; i++) if (w[i] != b.w[i]) return false;
+    return true;
+  }
+
+  // Same contract as dynamic_bitset's find_first and find_next
+  size_t find_first() const { return gf2_scan(w, W, 0); }
+  size_t find_next(size_t i) const { return gf2_scan(w, W, i + 1); }
+
+  // Short rows are cheaper to XOR inline than through the vector kernel
+  bitvec & operator^=(const bitvec & b) {
+    if (W >= 8) gf2_xor(w, b.w, W);
+    else for (int i = 0; i < W; i++) w[i] ^= b.w[i];
+    return *this;
+  }
+};
+
+// Conversions between xor_func and the fixed-width vectors. The xor_func
+//   keeps its size, so it has to have been sized before loading into it
+template <int W>
+inline void load_bits(bitvec<W> & dst, const xor_func & src) {
+  dst = bitvec<W>();
+  src.to_blocks(dst.w);
+}
+
+template <int W>
+inline void store_bits(xor_func & dst, const bitvec<W> & src) {
+  dst.from_blocks(src.w);
+}
+
+// Copy a row to or from n blocks of a gf2_matrix. The row's blocks past n
+//   have to be zero
+template <int W>
+inline void pack_bits(gf2_block * dst, const bitvec<W> & src, int n) {
+  copy(src.w, src.w + min(W, n), dst);
+}
+
+inline void pack_bits(gf2_block * dst, const xor_func & src, int n) {
+  src.to_blocks(dst);
+}
+
+template <int W>
+inline void unpack_bits(bitvec<W> & dst, const gf2_block * src, int n) {
+  dst = bitvec<W>();
+  copy(src, src + min(W, n), dst.w);
+}
+
+inline void unpack_bits(xor_func & dst, const gf2_block * src, int n) {
+  dst.from_blocks(src);
+}
+
+// Calls f with a null pointer to the narrowest bit vector type holding
+//   bits bits, falling back to xor_func for anything wider than 1024
+template <typename F>
+auto dispatch_width(size_t bits, F f) {
+  const size_t b = xor_func::bits_per_block;
+  if (bits <= 1*b)  return f((bitvec<1> *)NULL);
+  if (bits <= 2*b)  return f((bitvec<2> *)NULL);
+  if (bits <= 4*b)  return f((bitvec<4> *)NULL);
+  if (bits <= 8*b)  return f((bitvec<8> *)NULL);
+  if (bits <= 16*b) return f((bitvec<16> *)NULL);
+  return f((xor_func *)NULL);
+}
+
+// Width in bits of the widest of the first m rows
+inline size_t row_width(int m, const vector<xor_func> & rows) {
+  size_t ret = 0;
+  for (int i = 0; i < m; i++) if (rows[i].size() > ret) ret = rows[i].size();
+  return ret;
+}
+
+#endif
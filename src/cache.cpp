@@ -0,0 +1,195 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include "cache.h"
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+
+namespace fs = std::filesystem;
+
+//---------------------------- Hashing
+
+void hasher::add(uint64_t x) {
+  a = (a ^ x) * 0x9e3779b97f4a7c15ULL;
+  a ^= a >> 32;
+  b = (b + x) * 0xc2b2ae3d27d4eb4fULL;
+  b ^= b >> 29;
+}
+
+void hasher::add(const string & s) {
+  uint64_t w;
+  size_t i;
+
+  add(s.size());
+  for (i = 0; i + 8 <= s.size(); i += 8) {
+    memcpy(&w, s.data() + i, 8);
+    add(w);
+  }
+  for (w = 0; i < s.size(); i++) w = (w << 8) | (unsigned char)s[i];
+  add(w);
+}
+
+// Gates are hashed by name, since opcodes of interned gates depend on the
+//   order in which they were first seen
+void hasher::add(const dotqc & qc) {
+  add(qc.n);
+  add(qc.names.size());
+  for (size_t i = 0; i < qc.names.size(); i++) {
+    add(qc.names[i]);
+    add(qc.zero[i]);
+  }
+  add(qc.circ.size());
+  for (gatelist::const_iterator it = qc.circ.begin(); it != qc.circ.end(); it++) {
+    add(gate_name(it->type));
+    const int * args = qc.args_of(*it);
+    add(it->arity);
+    for (int i = 0; i < it->arity; i++) add(args[i]);
+  }
+}
+
+string hasher::digest() const {
+  uint64_t x = a, y = b;
+  stringstream ss;
+
+  // Final avalanche so that every input bit affects every output bit
+  x ^= y >> 31; x *= 0xff51afd7ed558ccdULL; x ^= x >> 33;
+  y ^= x >> 27; y *= 0xc4ceb9fe1a85ec53ULL; y ^= y >> 33;
+  ss << hex << setfill('0') << setw(16) << x << setw(16) << y;
+  return ss.str();
+}
+
+//---------------------------- Cache
+
+result_cache::result_cache(const string & dirin, uintmax_t max_bytesin) {
+  error_code ec;
+  dir = dirin;
+  max_bytes = max_bytesin;
+  fs::create_directories(dir, ec);
+}
+
+string result_cache::path(const string & key) const {
+  return (fs::path(dir) / (key + ".tpar")).string();
+}
+
+bool result_cache::lookup(const string & key, string & info, dotqc & circ) {
+  string file = path(key);
+  ifstream in(file.c_str(), ios::binary);
+  uint64_t len;
+  string err;
+  error_code ec;
+
+  if (!in) return false;
+  string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  in.close();
+
+  // Entries that are damaged or from an older format are dropped and
+  //   recomputed rather than treated as errors
+  circ.clear();
+  if (data.size() < sizeof(len)) {
+    fs::remove(file, ec);
+    return false;
+  }
+  memcpy(&len, data.data(), sizeof(len));
+  if (data.size() - sizeof(len) < len ||
+      !circ.read_qcb(data.data() + sizeof(len) + len, data.data() + data.size(), err)) {
+    circ.clear();
+    fs::remove(file, ec);
+    return false;
+  }
+  info = data.substr(sizeof(len), len);
+
+  // Mark the entry as recently used
+  fs::last_write_time(file, fs::file_time_type::clock::now(), ec);
+  return true;
+}
+
+void result_cache::store(const string & key, const string & info, const dotqc & circ) {
+  static atomic<int> counter(0);
+  stringstream tmp;
+  ostringstream entry;
+  error_code ec;
+  uint64_t len = info.size();
+  size_t done = 0;
+  ssize_t ret;
+  int fd;
+  bool ok;
+
+  entry.write((const char *)&len, sizeof(len));
+  entry << info;
+  {
+    qc_writer writer(entry, QCB);
+    writer.header(circ);
+    writer.gates(circ);
+    writer.footer();
+  }
+  string data = entry.str();
+
+  // Write to a file no one else is writing to and make sure it is on disk,
+  //   then move it into place
+  tmp << dir << "/.tmp." << getpid() << "." << counter++;
+  fd = open(tmp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return;
+  while (done < data.size()) {
+    ret = write(fd, data.data() + done, data.size() - done);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) break;
+    done += ret;
+  }
+  ok = done == data.size() && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  if (!ok) {
+    fs::remove(tmp.str(), ec);
+    return;
+  }
+  fs::rename(tmp.str(), path(key), ec);
+  if (ec) fs::remove(tmp.str(), ec);
+
+  evict();
+}
+
+// Remove least recently used entries until the cache fits its size limit
+void result_cache::evict() {
+  vector<pair<fs::file_time_type, fs::path> > entries;
+  uintmax_t total = 0, size;
+  error_code ec;
+
+  for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+    if (it->path().extension() != ".tpar") continue;
+    size = it->file_size(ec);
+    if (ec) continue;
+    total += size;
+    entries.push_back(make_pair(it->last_write_time(ec), it->path()));
+  }
+  if (total <= max_bytes) return;
+
+  sort(entries.begin(), entries.end());
+  for (size_t i = 0; i < entries.size() && total > max_bytes; i++) {
+    size = fs::file_size(entries[i].second, ec);
+    if (!ec && fs::remove(entries[i].second, ec)) total -= size;
+  }
+}
@@ -0,0 +1,63 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include <cstdint>
+#include "circuit.h"
+
+#ifndef CACHE
+#define CACHE
+
+// Streaming 128-bit hash built from two independently seeded 64-bit lanes.
+//   Not cryptographic, but collisions between circuits are vanishingly rare
+class hasher {
+  private:
+    uint64_t a, b;
+  public:
+    hasher() { a = 0x243f6a8885a308d3ULL; b = 0x13198a2e03707344ULL; }
+
+    void add(uint64_t x);
+    void add(const string & s);
+    void add(const dotqc & qc);
+    string digest() const;
+};
+
+// On-disk cache of optimization results, addressed by a hash of the input
+//   circuit and the options that affect the result. An entry holds the
+//   statistics text and the optimized circuit in .qcb form. Entries are
+//   written to a temporary file, synced and renamed into place, so readers
+//   never see a partial entry, and entries that fail to decode are removed.
+//   Once the cache grows past its size limit the least recently used
+//   entries are removed
+class result_cache {
+  private:
+    string dir;
+    uintmax_t max_bytes;
+
+    string path(const string & key) const;
+    void evict();
+  public:
+    result_cache(const string & dirin, uintmax_t max_bytesin);
+
+    bool lookup(const string & key, string & info, dotqc & circ);
+    void store(const string & key, const string & info, const dotqc & circ);
+};
+
+#endif
@@ -21,338 +21,656 @@ Author: Matthew Amy
 
 #include "circuit.h"
 #include <algorithm>
+#include <deque>
 #include <sstream>
+#include <fstream>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 //----------------------------------------- DOTQC stuff
 
-void ignore_white(istream& in) {
-  while (in.peek() == ' ' || in.peek() == ';') in.ignore();
+// Tokenizing is done in place over the whole file. Tokens are separated by
+//   spaces and tabs, and a ';' ends a gate just like a line break does
+inline bool is_blank(char c) { return c == ' ' || c == '\t'; }
+inline bool is_eol(char c) { return c == '\n' || c == '\r' || c == ';'; }
+
+// Next token on the current line, or an empty token at the end of the line
+string_view line_token(const char *& pos, const char * end) {
+  while (pos != end && is_blank(*pos)) pos++;
+  const char * start = pos;
+  while (pos != end && !is_blank(*pos) && !is_eol(*pos)) pos++;
+  return string_view(start, pos - start);
 }
 
-void dotqc::input(istream& in) {
-  string buf, tmp;
-  list<string> namelist;
+// Next token in the file, or an empty token at the end of the file
+string_view next_token(const char *& pos, const char * end) {
+  while (pos != end && (is_blank(*pos) || is_eol(*pos))) pos++;
+  return line_token(pos, end);
+}
+
+// Skip ahead to the given token, returning false if there is none
+bool find_token(const char *& pos, const char * end, string_view tok, string & err) {
+  string_view buf;
+  do {
+    buf = next_token(pos, end);
+    if (buf.empty()) {
+      err = "missing \"" + string(tok) + "\"";
+      return false;
+    }
+  } while (buf != tok);
+  return true;
+}
+
+// Parses a .qc file, returning false with a message in err if it is
+//   malformed. The circuit is left partially filled in on failure
+bool dotqc::read_qc(const char * pos, const char * end, string & err) {
+  string_view buf, tmp;
+  unordered_map<string_view, int> name_map;
+  unordered_map<string_view, int>::iterator name_it;
+  vector<int> qubits;
+  gate g;
   n = 0;
 
   // Inputs
-  while (buf != ".v") in >> buf;
-  ignore_white(in);
-  while(in.peek() != '\n' && in.peek() != '\r') {
-    in >> buf;
-    names.push_back(buf);
-    zero[buf] = 1;
-    ignore_white(in);
+  if (!find_token(pos, end, ".v", err)) return false;
+  for (buf = line_token(pos, end); !buf.empty(); buf = line_token(pos, end)) {
+    name_map[buf] = names.size();
+    names.push_back(string(buf));
+    zero.push_back(1);
   }
 
   // Primary inputs
-  while (buf != ".i") in >> buf;
-  ignore_white(in);
-  while (in.peek() != '\n' && in.peek() != '\r') {
+  if (!find_token(pos, end, ".i", err)) return false;
+  for (buf = line_token(pos, end); !buf.empty(); buf = line_token(pos, end)) {
     n++;
-    in >> buf;
-    zero[buf] = 0;
-    ignore_white(in);
+    name_it = name_map.find(buf);
+    if (name_it != name_map.end()) zero[name_it->second] = 0;
   }
 
   m = names.size() - n;
 
   // Circuit
-  while (buf != "BEGIN") in >> buf;
-  in >> tmp;
-  while (tmp != "END") {
-    namelist.clear();
+  if (!find_token(pos, end, "BEGIN", err)) return false;
+  for (tmp = next_token(pos, end); tmp != "END"; tmp = next_token(pos, end)) {
+    if (tmp.empty()) {
+      err = "missing \"END\"";
+      return false;
+    }
+    g = gate();
+    g.type = intern_gate(tmp);
     // Build up a list of the applied qubits
-    ignore_white(in);
-    while (in.peek() != '\n' && in.peek() != '\r' && in.peek() != ';') {
-      in >> buf;
-      int pos = buf.find(';');
-      if (pos != string::npos) {
-        for (int i = buf.length() - 1; i > pos; i--) {
-          in.putback(buf[i]);
-        }
-        in.putback('\n');
-        buf.erase(pos, buf.length() - pos);
+    qubits.clear();
+    for (buf = line_token(pos, end); !buf.empty(); buf = line_token(pos, end)) {
+      name_it = name_map.find(buf);
+      if (name_it == name_map.end()) {
+        err = "no such qubit \"" + string(buf) + "\"";
+        return false;
+      } else if (qubits.size() == USHRT_MAX) {
+        err = "gate \"" + string(tmp) + "\" has more than " + to_string(USHRT_MAX) + " qubits";
+        return false;
+      } else {
+        qubits.push_back(name_it->second);
+      }
+    }
+    g.arity = qubits.size();
+    add_gate(g, qubits.data());
+  }
+
+  return true;
+}
+
+// Binary circuits (.qcb) consist of
+//   "QCB" <version>
+//   <#qubits> <n> then for each qubit <name length> <name> <zero flag>
+//   <#gate names> then for each gate name <name length> <name>
+//   a record per gate <(opcode + 1) * 8 + arity> <qubit>..., then a 0
+// Gates on 7 or more qubits have 7 in place of the arity, followed by the
+//   arity itself. All numbers other than the version and zero flags are
+//   varints
+#define QCB_LONG_ARITY 7
+#define QCB_VERSION 1
+
+// Readers return false on truncated input, leaving the result undefined
+bool read_varint(const char *& pos, const char * end, unsigned long & ret) {
+  int shift = 0;
+  unsigned char c;
+
+  ret = 0;
+  do {
+    if (pos == end || shift > 56) return false;
+    c = *(pos++);
+    ret |= (unsigned long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return true;
+}
+
+bool read_string(const char *& pos, const char * end, string_view & ret) {
+  unsigned long len;
+
+  if (!read_varint(pos, end, len) || (unsigned long)(end - pos) < len) return false;
+  ret = string_view(pos, len);
+  pos += len;
+  return true;
+}
+
+// Decodes a .qcb file, returning false with a message in err if it is
+//   malformed. The circuit is left partially filled in on failure
+bool dotqc::read_qcb(const char * pos, const char * end, string & err) {
+  unsigned long num, rec, arg;
+  string_view name;
+  vector<gate_op> ops;
+  vector<int> qubits;
+  gate g;
+
+  if (end - pos < 4 || string_view(pos, 3) != "QCB") {
+    err = "not a .qcb file";
+    return false;
+  }
+  if (pos[3] != QCB_VERSION) {
+    err = "unsupported .qcb version " + to_string((int)pos[3]);
+    return false;
+  }
+  pos += 4;
+  err = "truncated .qcb file";
+
+  // Qubits
+  if (!read_varint(pos, end, num) || !read_varint(pos, end, rec)) return false;
+  n = rec;
+  m = num - n;
+  for (unsigned long i = 0; i < num; i++) {
+    if (!read_string(pos, end, name) || pos == end) return false;
+    names.push_back(string(name));
+    zero.push_back(*(pos++) != 0);
+  }
+
+  // Gate names used in the file
+  if (!read_varint(pos, end, num)) return false;
+  for (unsigned long i = 0; i < num; i++) {
+    if (!read_string(pos, end, name)) return false;
+    ops.push_back(intern_gate(name));
+  }
+
+  // Gates
+  while (true) {
+    if (!read_varint(pos, end, rec)) return false;
+    if (rec == 0) break;
+    g = gate();
+    num = rec & 7;
+    if (num == QCB_LONG_ARITY && !read_varint(pos, end, num)) return false;
+    if ((rec >> 3) == 0 || (rec >> 3) > ops.size() || num > USHRT_MAX) {
+      err = "malformed gate in .qcb file";
+      return false;
+    }
+    g.type = ops[(rec >> 3) - 1];
+    g.arity = num;
+    qubits.clear();
+    for (int i = 0; i < g.arity; i++) {
+      if (!read_varint(pos, end, arg)) return false;
+      if (arg >= names.size()) {
+        err = "no such qubit " + to_string(arg) + " in .qcb file";
+        return false;
       }
-      if (find(names.begin(), names.end(), buf) == names.end()) {
-        cout << "ERROR: no such qubit \"" << buf << "\"\n" << flush;
+      qubits.push_back(arg);
+    }
+    add_gate(g, qubits.data());
+  }
+
+  err.clear();
+  return true;
+}
+
+// Callers that only look at err rely on it being empty after a success
+bool dotqc::decode(const char * pos, const char * end, qc_format fmt, string & err) {
+  bool ok = (fmt == QCB) ? read_qcb(pos, end, err) : read_qc(pos, end, err);
+
+  if (ok) err.clear();
+  return ok;
+}
+
+// Parse straight out of a file descriptor if it can be memory mapped.
+//   Returns whether it could, with any error parsing it in err
+bool dotqc::input_mmap(int fd, qc_format fmt, string & err) {
+  struct stat st;
+  void * buf;
+
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return false;
+  buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (buf == MAP_FAILED) return false;
+  madvise(buf, st.st_size, MADV_SEQUENTIAL);
+
+  decode((const char *)buf, (const char *)buf + st.st_size, fmt, err);
+  munmap(buf, st.st_size);
+  return true;
+}
+
+// Reads a circuit, returning false with a message in err if the file can't
+//   be opened or parsed
+bool dotqc::read(const string & path, qc_format fmt, string & err) {
+  int fd = open(path.c_str(), O_RDONLY);
+
+  err.clear();
+  if (fd < 0) {
+    err = "could not open \"" + path + "\"";
+    return false;
+  }
+  if (!input_mmap(fd, fmt, err)) {
+    ifstream in(path.c_str(), ios::binary);
+    read(in, fmt, err);
+  }
+  close(fd);
+  return err.empty();
+}
+
+bool dotqc::read(istream& in, qc_format fmt, string & err) {
+  err.clear();
+  // Standard input redirected from a file can be mapped directly
+  if (&in == &cin && input_mmap(STDIN_FILENO, fmt, err)) return err.empty();
+
+  // Otherwise read the whole stream in large chunks and parse the buffer
+  vector<char> buf;
+  streamsize len = 0, got;
+  do {
+    buf.resize(len + (1 << 20));
+    got = in.rdbuf()->sgetn(&buf[len], 1 << 20);
+    len += got;
+  } while (got > 0);
+
+  return decode(buf.data(), buf.data() + len, fmt, err);
+}
+
+void dotqc::input(const string & path, qc_format fmt) {
+  string err;
+
+  if (!read(path, fmt, err)) {
+    cout << "ERROR: " << err << "\n" << flush;
+    exit(1);
+  }
+}
+
+void dotqc::input(istream& in, qc_format fmt) {
+  string err;
+
+  if (!read(in, fmt, err)) {
+    cout << "ERROR: " << err << "\n" << flush;
+    exit(1);
+  }
+}
+
+qc_writer::qc_writer(int fdin, qc_format fmtin, size_t size) : stats(0) {
+  fmt = fmtin;
+  fd = fdin;
+  os = NULL;
+  buf.resize(size);
+  len = 0;
+}
+
+qc_writer::qc_writer(ostream& out, qc_format fmtin, size_t size) : stats(0) {
+  fmt = fmtin;
+  fd = -1;
+  os = &out;
+  buf.resize(size);
+  len = 0;
+}
+
+void qc_writer::flush() {
+  size_t done = 0;
+  ssize_t ret;
+
+  if (os != NULL) {
+    os->write(buf.data(), len);
+    os->flush();
+  } else {
+    // Anything already sent to cout has to go out first
+    if (fd == STDOUT_FILENO) cout.flush();
+    while (done < len) {
+      ret = ::write(fd, buf.data() + done, len - done);
+      if (ret < 0 && errno != EINTR) {
+        cerr << "ERROR: write failed\n";
         exit(1);
-      } else {
-        namelist.push_back(buf);
       }
-      ignore_white(in);
+      if (ret > 0) done += ret;
     }
-    if (tmp == "TOF") tmp = "tof";
-    circ.push_back(make_pair(tmp, namelist));
-    in >> tmp;
   }
+  len = 0;
 }
 
-void dotqc::output(ostream& out) {
-  list<string>::iterator name_it;
-  gatelist::iterator it;
-  list<string>::iterator ti;
+void qc_writer::put(const char * s, size_t n) {
+  if (len + n > buf.size()) {
+    flush();
+    if (n > buf.size()) buf.resize(n);
+  }
+  memcpy(buf.data() + len, s, n);
+  len += n;
+}
+
+void qc_writer::put_varint(unsigned long x) {
+  while (x >= 0x80) {
+    put((char)((x & 0x7f) | 0x80));
+    x >>= 7;
+  }
+  put((char)x);
+}
+
+void qc_writer::header(const dotqc & qc) {
+  int i;
+  stats = qc_stats(qc.names.size());
+
+  if (fmt == QCB) {
+    put("QCB");
+    put((char)QCB_VERSION);
+    put_varint(qc.names.size());
+    put_varint(qc.n);
+    for (i = 0; i < (int)qc.names.size(); i++) {
+      put_varint(qc.names[i].size());
+      put(qc.names[i]);
+      put((char)qc.zero[i]);
+    }
+    // Every gate name known so far, so that opcodes can be written as is
+    put_varint(num_gate_names());
+    for (i = 0; i < num_gate_names(); i++) {
+      put_varint(gate_name(i).size());
+      put(gate_name(i));
+    }
+    return;
+  }
 
   // Inputs
-  out << ".v";
-  for (name_it = names.begin(); name_it != names.end(); name_it++) {
-    out << " " << *name_it;
+  put(".v");
+  for (i = 0; i < (int)qc.names.size(); i++) {
+    put(' ');
+    put(qc.names[i]);
   }
 
   // Primary inputs
-  out << "\n.i";
-  for (name_it = names.begin(); name_it != names.end(); name_it++) {
-    if (zero[*name_it] == 0) out << " " << *name_it;
+  put("\n.i");
+  for (i = 0; i < (int)qc.names.size(); i++) {
+    if (qc.zero[i] == 0) {
+      put(' ');
+      put(qc.names[i]);
+    }
   }
 
   // Outputs
-  out << "\n.o";
-  for (name_it = names.begin(); name_it != names.end(); name_it++) {
-    out << " " << *name_it;
+  put("\n.o");
+  for (i = 0; i < (int)qc.names.size(); i++) {
+    put(' ');
+    put(qc.names[i]);
   }
 
   // Circuit
-  out << "\n\nBEGIN\n";
-  for (it = circ.begin(); it != circ.end(); it++) {
-    out << it->first;
-    for (ti = (it->second).begin(); ti != (it->second).end(); ti++) {
-      out << " " << *ti;
+  put("\n\nBEGIN\n");
+}
+
+void qc_writer::gates(const dotqc & qc) {
+  gatelist::const_iterator it;
+
+  for (it = qc.circ.begin(); it != qc.circ.end(); it++) {
+    const int * args = qc.args_of(*it);
+    stats.add(*it, args);
+    if (fmt == QCB) {
+      if (it->arity < QCB_LONG_ARITY) {
+        put_varint((it->type + 1) * 8 + it->arity);
+      } else {
+        put_varint((it->type + 1) * 8 + QCB_LONG_ARITY);
+        put_varint(it->arity);
+      }
+      for (int i = 0; i < it->arity; i++) put_varint(args[i]);
+      continue;
     }
-    out << "\n";
+    put(gate_name(it->type));
+    for (int i = 0; i < it->arity; i++) {
+      put(' ');
+      put(qc.names[args[i]]);
+    }
+    put('\n');
   }
-  out << "END\n";
 }
 
-int max_depth(map<string, int> & depths, list<string> & names) {
-  list<string>::const_iterator it;
+void qc_writer::footer() {
+  if (fmt == QCB) put((char)0);
+  else            put("END\n");
+}
+
+// Write out a finished prefix of the circuit, making room for the rest
+void qc_writer::stream(dotqc & qc) {
+  gates(qc);
+  qc.circ.clear();
+  flush();
+}
+
+void dotqc::output(ostream& out, qc_format fmt) {
+  qc_writer writer(out, fmt);
+  writer.header(*this);
+  writer.gates(*this);
+  writer.footer();
+  writer.flush();
+}
+
+void dotqc::print(qc_format fmt) {
+  qc_writer writer(STDOUT_FILENO, fmt);
+  writer.header(*this);
+  writer.gates(*this);
+  writer.footer();
+  writer.flush();
+}
+
+qc_stats::qc_stats(int num) {
+  H = cnot = X = T = P = Z = tdepth = used = 0;
+  tlayer = false;
+  qubits = vector<bool>(num, false);
+  depth = vector<int>(num, 0);
+  t_depth = vector<int>(num, 0);
+}
+
+int max_depth(const vector<int> & depths, const gate & g, const int * args) {
   int max = 0;
 
-  for (it = names.begin(); it != names.end(); it++) {
-    if (depths[*it] > max) max = depths[*it];
+  for (int i = 0; i < g.arity; i++) {
+    if (depths[args[i]] > max) max = depths[args[i]];
   }
 
   return max;
 }
 
-// Compute T-depth
-int dotqc::count_t_depth() {
-  gatelist::reverse_iterator it;
-  list<string>::const_iterator ti;
-  map<string, int> current_t_depth;
-
-  for (ti = names.begin(); ti != names.end(); ti++) {
-    current_t_depth[*ti] = 0;
-  }
+int max_depth(const vector<int> & depths) {
+  int max = 0;
 
-  for (it = circ.rbegin(); it != circ.rend(); it++) {
-    int d = max_depth(current_t_depth, it->second);
-    if ((it->first == "T") || (it->first == "T*")) {
-      d = d + 1;
-    } else if ((it->first == "Z") && (it->second.size() >= 3)) {
-      d = d + 3;
-    }
-    for (ti = it->second.begin(); ti != it->second.end(); ti++) {
-      current_t_depth[*ti] = d;
-    }
+  for (int i = 0; i < (int)depths.size(); i++) {
+    if (depths[i] > max) max = depths[i];
   }
 
-  return max_depth(current_t_depth, names);
+  return max;
 }
 
-int dotqc::count_depth() {
-  gatelist::reverse_iterator it;
-  list<string>::const_iterator ti;
-  map<string, int> current_depth;
-  int d;
+void qc_stats::add(const gate & g, const int * args) {
+  int d, td, i;
 
-  for (ti = names.begin(); ti != names.end(); ti++) {
-    current_depth[*ti] = 0;
+  for (i = 0; i < g.arity; i++) {
+    if (!qubits[args[i]]) {
+      qubits[args[i]] = true;
+      used++;
+    }
   }
 
-  for (it = circ.rbegin(); it != circ.rend(); it++) {
-    d = max_depth(current_depth, it->second);
-    if ((it->first == "Z") && (it->second.size() >= 3)) {
-      d = d + 9;
-    } else {
-      d = d + 1;
-    }
-    for (ti = it->second.begin(); ti != it->second.end(); ti++) {
-      current_depth[*ti] = d;
+  // Gate counts and T-depth by partitions
+  if (g.type == GATE_T || g.type == GATE_TDAG) {
+    T++;
+    if (!tlayer) {
+      tlayer = true;
+      tdepth++;
     }
+  } else if (g.type == GATE_P || g.type == GATE_PDAG) P++;
+  else if (g.type == GATE_Z && g.arity == 3) {
+    tdepth += 3;
+    T += 7;
+    cnot += 7;
+  } else if (g.type == GATE_Z) Z++;
+  else {
+    if (g.type == GATE_TOF && g.arity == 2) cnot++;
+    else if (g.type == GATE_TOF || g.type == GATE_X) X++;
+    else if (g.type == GATE_H) H++;
+
+    if (tlayer) tlayer = false;
   }
 
-  return max_depth(current_depth, names);
+  // Critical paths. The longest path is the same whichever end of the
+  //   circuit it is computed from, so this can be done as gates arrive
+  d = max_depth(depth, g, args);
+  td = max_depth(t_depth, g, args);
+  if ((g.type == GATE_Z) && (g.arity >= 3)) {
+    d = d + 9;
+    td = td + 3;
+  } else {
+    d = d + 1;
+    if ((g.type == GATE_T) || (g.type == GATE_TDAG)) td = td + 1;
+  }
+  for (i = 0; i < g.arity; i++) {
+    depth[args[i]] = d;
+    t_depth[args[i]] = td;
+  }
 }
 
-// Gather statistics and print
-void dotqc::print_stats() {
-  int H = 0;
-  int cnot = 0;
-  int X = 0;
-  int T = 0;
-  int P = 0;
-  int Z = 0;
-  int tdepth = 0;
-  bool tlayer = false;
-  gatelist::iterator ti;
-  set<string> qubits;
-  list<string>::iterator it;
-
-  for (ti = circ.begin(); ti != circ.end(); ti++) {
-    for (it = ti->second.begin(); it != ti->second.end(); it++) qubits.insert(*it);
-    if (ti->first == "T" || ti->first == "T*") {
-      T++;
-      if (!tlayer) {
-        tlayer = true;
-        tdepth++;
-      }
-    } else if (ti->first == "P" || ti->first == "P*") P++;
-    else if (ti->first == "Z" && ti->second.size() == 3) {
-      tdepth += 3;
-      T += 7;
-      cnot += 7;
-    } else if (ti->first == "Z") Z++;
-    else {
-      if (ti->first == "tof" && ti->second.size() == 2) cnot++;
-      else if (ti->first == "tof" || ti->first == "X") X++;
-      else if (ti->first == "H") H++;
-
-      if (tlayer) tlayer = false;
-    }
+void qc_stats::print(ostream& out) {
+  out << "#   qubits: " << qubits.size() << "\n";
+  out << "#   qubits used: " << used << "\n";
+  out << "#   H: " << H << "\n";
+  out << "#   cnot: " << cnot << "\n";
+  out << "#   X: " << X << "\n";
+  out << "#   T: " << T << "\n";
+  out << "#   P: " << P << "\n";
+  out << "#   Z: " << Z << "\n";
+  out << "#   tdepth (by partitions): " << tdepth << "\n";
+  out << "#   depth  (by critical paths): " << max_depth(depth) << "\n";
+  out << "#   tdepth (by critical paths): " << max_depth(t_depth) << "\n";
+}
+
+qc_stats dotqc::stats() {
+  qc_stats ret(names.size());
+  for (gatelist::iterator it = circ.begin(); it != circ.end(); it++) {
+    ret.add(*it, args_of(*it));
   }
+  return ret;
+}
 
-  cout << "#   qubits: " << names.size() << "\n";
-  cout << "#   qubits used: " << qubits.size() << "\n";
-  cout << "#   H: " << H << "\n";
-  cout << "#   cnot: " << cnot << "\n";
-  cout << "#   X: " << X << "\n";
-  cout << "#   T: " << T << "\n";
-  cout << "#   P: " << P << "\n";
-  cout << "#   Z: " << Z << "\n";
-  cout << "#   tdepth (by partitions): " << tdepth << "\n";
-  cout << "#   depth  (by critical paths): " << count_depth() << "\n";
-  cout << "#   tdepth (by critical paths): " << count_t_depth() << "\n";
+// Compute T-depth
+int dotqc::count_t_depth() {
+  return max_depth(stats().t_depth);
+}
+
+int dotqc::count_depth() {
+  return max_depth(stats().depth);
+}
 
+// Gather statistics and print
+void dotqc::print_stats(ostream& out) {
+  stats().print(out);
 }
 
 // Count the Hadamard gates
 int count_h(dotqc & qc) {
   int ret = 0;
-  list<pair<string,list<string> > >::iterator it;
+  gatelist::iterator it;
 
   for (it = qc.circ.begin(); it != qc.circ.end(); it++) {
-    if (it->first == "H") ret++;
+    if (it->type == GATE_H) ret++;
   }
 
   return ret;
 }
 
-bool find_name(const list<string> & names, const string & name) {
-  list<string>::const_iterator it;
-  for (it = names.begin(); it != names.end(); it++) {
-    if (*it == name) return true;
-  }
-  return false;
+// Qubit indices sorted by qubit name
+vector<int> name_order(const vector<string> & names) {
+  vector<int> ret(names.size());
+  for (int i = 0; i < (int)names.size(); i++) ret[i] = i;
+  sort(ret.begin(), ret.end(), [&names](int a, int b) { return names[a] < names[b]; });
+  return ret;
 }
 
-void dotqc::append(pair<string, list<string> > gate) {
-  circ.push_back(gate);
+bool is_cnot(const gate & g) {
+  return g.type == GATE_TOF && g.arity == 2;
+}
 
-  for (list<string>::iterator it = gate.second.begin(); it != gate.second.end(); it++) {
-    if (!find_name(names, *it)) names.push_back(*it);
+int * dotqc::add_gate(const gate & g, const int * args) {
+  circ.push_back(g);
+  gate & ret = circ.back();
+  if (ret.wide()) {
+    ret.args[0] = wide_args.size();
+    wide_args.insert(wide_args.end(), args, args + ret.arity);
+  } else {
+    copy(args, args + ret.arity, ret.args);
   }
+  return args_of(ret);
 }
 
 // Optimizations
-void dotqc::remove_swaps() {
-  gatelist::iterator it, tt, ttt;
-  list<string>::iterator iti;
-  map<string, string>::iterator pit;
-  string q1, q2, q1_map, q2_map, tmp;
-  bool flg, found_q1, found_q2;
-  int i;
-  map<string, string> perm;
-
-  for (it = circ.begin(), i = 0; i < (circ.size() - 3);) {
-    flg = false;
-    if (it->first == "tof" && it->second.size() == 2) {
-      iti = it->second.begin();
-      q1 = *(iti++);
-      q2 = *iti;
-
-      tt = it;
-      tt++;
-      ttt = tt;
-      ttt++;
-      if (tt->first == "tof" && tt->second.size() == 2 && ttt->first == "tof" && ttt->second.size() == 2) {
-        flg = true;
-        iti = tt->second.begin();
-        flg &= *(iti++) == q2;
-        flg &= *(iti) == q1;
-        iti = ttt->second.begin();
-        flg &= *(iti++) == q1;
-        flg &= *(iti) == q2;
-
-        if (flg) {
-          circ.erase(it);
-          circ.erase(tt);
-          it = circ.erase(ttt);
-          found_q1 = found_q2 = false;
-          q1_map = (perm.find(q2) != perm.end()) ? perm[q2] : q2;
-          q2_map = (perm.find(q1) != perm.end()) ? perm[q1] : q1;
-          perm[q1] = q1_map;
-          perm[q2] = q2_map;
-        }
+void dotqc::remove_swaps(bool fix) {
+  int i, j, q1, q2, tmp;
+  vector<int> perm(names.size());
+  vector<int> order = name_order(names);
+
+  for (i = 0; i < (int)names.size(); i++) perm[i] = i;
+
+  // i reads the circuit, j writes the gates that are kept
+  for (i = 0, j = 0; i + 3 < (int)circ.size();) {
+    gate & g = circ[i];
+    if (is_cnot(g) && is_cnot(circ[i+1]) && is_cnot(circ[i+2])) {
+      q1 = g.args[0];
+      q2 = g.args[1];
+      if (circ[i+1].args[0] == q2 && circ[i+1].args[1] == q1 &&
+          circ[i+2].args[0] == q1 && circ[i+2].args[1] == q2) {
+        i += 3;
+        tmp = perm[q2];
+        perm[q2] = perm[q1];
+        perm[q1] = tmp;
+        continue;
       }
     }
-    if (!flg) {
-      // Apply permutation
-      for (iti = it->second.begin(); iti != it->second.end(); iti++) {
-        if (perm.find(*iti) != perm.end()) *iti = perm[*iti];
-      }
-      i++;
-      it++;
-    }
+    // Apply permutation
+    int * args = args_of(g);
+    for (int k = 0; k < g.arity; k++) args[k] = perm[args[k]];
+    circ[j++] = g;
+    i++;
   }
-  for (; i < circ.size(); i++) {
-    for (iti = it->second.begin(); iti != it->second.end(); iti++) {
-      if (perm.find(*iti) != perm.end()) *iti = perm[*iti];
-    }
-    it++;
+  for (; i < (int)circ.size(); i++) {
+    gate & g = circ[i];
+    int * args = args_of(g);
+    for (int k = 0; k < g.arity; k++) args[k] = perm[args[k]];
+    circ[j++] = g;
   }
+  circ.resize(j);
 
   // fix outputs
-  while(!perm.empty()) {
-    pit = perm.begin();
-    if (pit->first == pit->second) perm.erase(pit);
-    else {
-      list<string> tmp_list1, tmp_list2;
-      q1 = pit->second;
-      q2 = perm[pit->second];
-      tmp_list1.push_back(q1);
-      tmp_list1.push_back(q2);
-      tmp_list2.push_back(q2);
-      tmp_list2.push_back(q1);
-      circ.push_back(make_pair("tof", tmp_list1));
-      circ.push_back(make_pair("tof", tmp_list2));
-      circ.push_back(make_pair("tof", tmp_list1));
-
-      pit->second = q2;
+  for (i = 0; fix && i < (int)order.size(); i++) {
+    int q = order[i];
+    while (perm[q] != q) {
+      q1 = perm[q];
+      q2 = perm[q1];
+      circ.push_back(gate(GATE_TOF, q1, q2));
+      circ.push_back(gate(GATE_TOF, q2, q1));
+      circ.push_back(gate(GATE_TOF, q1, q2));
+
+      perm[q] = q2;
       perm[q1] = q1;
     }
   }
 }
 
-int list_compare(const list<string> & a, const list<string> & b) {
-  list<string>::const_iterator it, ti;
-  bool disjoint = true, equal = true, elt, strongelt;
-  int i = a.size(), j = b.size();
+int list_compare(const gate & a, const int * a_args, const gate & b, const int * b_args) {
+  bool disjoint = true, equal = true, strongelt;
+  int i, j;
 
-  for (it = a.begin(), i = 0; i < a.size(); i++, it++) {
-    elt = false;
+  for (i = 0; i < a.arity; i++) {
     strongelt = false;
-    for (ti = b.begin(), j = 0; j < b.size(); j++, ti++) {
-      if (*it == *ti) {
-        elt = true;
+    for (j = 0; j < b.arity; j++) {
+      if (a_args[i] == b_args[j]) {
         disjoint = false;
         if (i == j) {
           strongelt = true;
@@ -367,34 +685,49 @@ int list_compare(const list<string> & a, const list<string> & b) {
   else return 1;
 }
 
+// Whether b is the inverse of a, for the gates we know how to cancel
+bool is_inverse(gate_op a, gate_op b) {
+  switch (a) {
+    case GATE_TOF:
+    case GATE_Z:
+    case GATE_H:
+      return b == a;
+    case GATE_P:
+      return b == GATE_PDAG;
+    case GATE_PDAG:
+      return b == GATE_P;
+    case GATE_T:
+      return b == GATE_TDAG;
+    case GATE_TDAG:
+      return b == GATE_T;
+    default:
+      return false;
+  }
+}
+
 void dotqc::remove_ids() {
-  gatelist::iterator it, ti;
+  int it, ti, k;
   bool mod = true, flg = true;
-  int i;
-  map<string, string> ids;
-
-  ids["tof"] = "tof";
-  ids["Z"] = "Z";
-  ids["H"] = "H";
-  ids["P"] = "P*";
-  ids["P*"] = "P";
-  ids["T"] = "T*";
-  ids["T*"] = "T";
+  vector<bool> removed;
 
+  // Cancelled gates are only marked during a pass, and compacted after it
   while (mod) {
     mod = false;
-    for (it = circ.begin(); it != circ.end(); it++) {
+    removed.assign(circ.size(), false);
+    for (it = 0; it < (int)circ.size(); it++) {
+      if (removed[it]) continue;
       flg = false;
-      ti = it;
-      ti++;
-      for (; ti != circ.end() && !flg; ti++) {
-        i = list_compare(it->second, ti->second);
-        switch (i) {
+      for (ti = it + 1; ti < (int)circ.size() && !flg; ti++) {
+        if (removed[ti]) continue;
+        switch (list_compare(circ[it], args_of(circ[it]), circ[ti], args_of(circ[ti]))) {
           case 3:
-            if (ids[it->first] == ti->first) {
-              ti = circ.erase(ti);
-              it = circ.erase(it);
+            if (is_inverse(circ[it].type, circ[ti].type)) {
+              removed[it] = removed[ti] = true;
               mod = true;
+              // Scanning resumes after the first gate that survives it
+              for (k = it + 1; k < (int)circ.size() && removed[k]; k++);
+              if (k == (int)circ.size()) it = -1;
+              else it = k;
             }
             flg = true;
             break;
@@ -406,6 +739,12 @@ void dotqc::remove_ids() {
         }
       }
     }
+    if (mod) {
+      for (it = 0, k = 0; it < (int)circ.size(); it++) {
+        if (!removed[it]) circ[k++] = circ[it];
+      }
+      circ.resize(k);
+    }
   }
 }
 
@@ -453,23 +792,36 @@ void character::output(ostream& out) {
   out << ">\n";
 
   // Print the Hadamards:
-  for (list<Hadamard>::iterator ti = hadamards.begin(); ti != hadamards.end(); ti++) {
+  for (vector<Hadamard>::iterator ti = hadamards.begin(); ti != hadamards.end(); ti++) {
     out << "H:" << names[ti->qubit] << "-->" << ti->prep << "\n";
   }
 }
 
-int insert_phase (unsigned char c, xor_func f, vector<exponent> & phases) {
-  int i;
+// Add omega^c to the coefficient of f, returning the index of f's term
+int insert_phase (unsigned char c, const xor_func & f, vector<exponent> & phases,
+                  unordered_map<xor_func, int, xor_func_hash> & index) {
+  auto ret = index.emplace(f, phases.size());
 
-  for (i = 0; i < phases.size(); i++) {
-    if (phases[i].second == f) {
-      phases[i].first = (phases[i].first + c) % 8;
-      return i;
-    }
+  if (ret.second) {
+    phases.push_back(make_pair(c, f));
+  } else {
+    exponent & e = phases[ret.first->second];
+    e.first = (e.first + c) % 8;
   }
+  return ret.first->second;
+}
 
-  phases.push_back(make_pair(c, xor_func(f)));
-  return i;
+// Power of omega applied by a single qubit phase gate
+int phase_lookup(gate_op op) {
+  switch (op) {
+    case GATE_T:    return 1;
+    case GATE_P:    return 2;
+    case GATE_Z:
+    case GATE_Y:    return 4;
+    case GATE_PDAG: return 6;
+    case GATE_TDAG: return 7;
+    default:        return 0;
+  }
 }
 
 // Parse a {CNOT, T} circuit
@@ -481,119 +833,128 @@ void character::parse_circuit(dotqc & input) {
   h = count_h(input);
 
   hadamards.clear();
-  map<string, int> name_map, gate_lookup;
-  gate_lookup["T"] = 1;
-  gate_lookup["T*"] = 7;
-  gate_lookup["P"] = 2;
-  gate_lookup["P*"] = 6;
-  gate_lookup["Z"] = 4;
-  gate_lookup["Y"] = 4;
+  stages.clear();
+  phase_expts.clear();
+  phase_index.clear();
 
   // Initialize names and wires
   names = vector<string>(n + m + h);
   zero  = vector<bool>  (n + m);
   auto wires = vector<xor_func>(n+m);
-  for (list<string>::iterator it = input.names.begin(); it != input.names.end(); it++) {
-    // name_map maps a name to a wire
-    name_map[*it] = name_max;
+  for (name_max = 0; name_max < (int)input.names.size(); name_max++) {
     // names maps a wire to a name
-    names[name_max] = *it;
+    names[name_max] = input.names[name_max];
     // zero mapping
-    zero[name_max]  = input.zero[*it];
+    zero[name_max]  = input.zero[name_max];
     // each wire has an initial value j, unless it starts in the 0 state
     wires[name_max] = xor_func(n + h + 1, 0);
     if (!zero[name_max]) {
       wires[name_max].set(val_max);
       val_map[val_max++] = name_max;
     }
-    name_max++;
   }
 
-  bool flg;
+  // Span of the wires, for deciding which terms each Hadamard cuts off
+  wire_basis basis(n + m, n + h, wires);
+  vector<int> last_h(n + m, -1);  // last hadamard applied to each qubit
+  xor_func used(n + h + 1);       // values a hadamard depends on
+  gatelist delta;                 // linear gates since the last hadamard
 
   gatelist::iterator it;
   for (it = input.circ.begin(); it != input.circ.end(); it++) {
-    flg = false;
-    if (it->first == "tof" && it->second.size() == 2) {
-      wires[name_map[*(++(it->second.begin()))]] ^= wires[name_map[*(it->second.begin())]];
-    } else if ((it->first == "tof" || it->first == "X") && it->second.size() == 1) {
-      wires[name_map[*(it->second.begin())]].flip(n + h);
-    } else if (it->first == "Y" && it->second.size() == 1) {
-      a = name_map[*(it->second.begin())];
-      insert_phase(gate_lookup[it->first], wires[a], phase_expts);
-      wires[name_map[*(it->second.begin())]].flip(n + h);
-    } else if (it->first == "T" || it->first == "T*" ||
-        it->first == "P" || it->first == "P*" ||
-        (it->first == "Z" && it->second.size() == 1)) {
-      a = name_map[*(it->second.begin())];
-      insert_phase(gate_lookup[it->first], wires[a], phase_expts);
-    } else if (it->first == "Z" && it->second.size() == 3) {
-      list<string>::iterator tmp_it = it->second.begin();
-      a = name_map[*(tmp_it++)];
-      b = name_map[*(tmp_it++)];
-      c = name_map[*tmp_it];
-      insert_phase(1, wires[a], phase_expts);
-      insert_phase(1, wires[b], phase_expts);
-      insert_phase(1, wires[c], phase_expts);
-      insert_phase(7, wires[a] ^ wires[b], phase_expts);
-      insert_phase(7, wires[a] ^ wires[c], phase_expts);
-      insert_phase(7, wires[b] ^ wires[c], phase_expts);
-      insert_phase(1, wires[a] ^ wires[b] ^ wires[c], phase_expts);
-    } else if (it->first == "H") {
-      // This WILL confuse you later on you idiot
-      //   You zero the "destroyed" qubit, compute the rank, then replace the
-      //   value with each of the phase exponents to see if the rank increases
-      //   i.e. the system is inconsistent. This is so you don't have to make
-      //   a new matrix -- i.e. instead of preparing the new value and computing
-      //   rank, then adding each phase exponent and checking the rank you do it
-      //   in place
+    if (it->type == GATE_TOF && it->arity == 2) {
+      wires[it->args[1]] ^= wires[it->args[0]];
+      basis.cnot(it->args[0], it->args[1]);
+      delta.push_back(gate(GATE_TOF, it->args[0], it->args[1]));
+    } else if ((it->type == GATE_TOF || it->type == GATE_X) && it->arity == 1) {
+      wires[it->args[0]].flip(n + h);
+      delta.push_back(gate(GATE_X, it->args[0]));
+    } else if (it->type == GATE_Y && it->arity == 1) {
+      a = it->args[0];
+      insert_phase(phase_lookup(it->type), wires[a], phase_expts, phase_index);
+      wires[a].flip(n + h);
+      delta.push_back(gate(GATE_X, a));
+    } else if ((it->type == GATE_T || it->type == GATE_TDAG ||
+        it->type == GATE_P || it->type == GATE_PDAG) && it->arity >= 1) {
+      a = it->args[0];
+      insert_phase(phase_lookup(it->type), wires[a], phase_expts, phase_index);
+    } else if (it->type == GATE_Z && it->arity == 1) {
+      a = it->args[0];
+      insert_phase(phase_lookup(it->type), wires[a], phase_expts, phase_index);
+    } else if (it->type == GATE_Z && it->arity == 3) {
+      a = it->args[0];
+      b = it->args[1];
+      c = it->args[2];
+      insert_phase(1, wires[a], phase_expts, phase_index);
+      insert_phase(1, wires[b], phase_expts, phase_index);
+      insert_phase(1, wires[c], phase_expts, phase_index);
+      insert_phase(7, wires[a] ^ wires[b], phase_expts, phase_index);
+      insert_phase(7, wires[a] ^ wires[c], phase_expts, phase_index);
+      insert_phase(7, wires[b] ^ wires[c], phase_expts, phase_index);
+      insert_phase(1, wires[a] ^ wires[b] ^ wires[c], phase_expts, phase_index);
+    } else if (it->type == GATE_H && it->arity >= 1) {
+      // A phase term has to be applied before the Hadamard if it can't be
+      //   computed from the remaining wires, i.e. it isn't in their span
       Hadamard new_h;
-      new_h.qubit = name_map[*(it->second.begin())];
+      new_h.qubit = it->args[0];
       new_h.prep  = val_max++;
-      new_h.wires = vector<xor_func>(n + m);
-      for (int i = 0; i < n + m; i++) {
-        new_h.wires[i] = wires[i];
-      }
+      new_h.delta = std::move(delta);
+      delta.clear();
 
       // Check previous exponents to see if they're inconsistent
-      wires[new_h.qubit].reset();
-      compute_rank_dest(n + m, n + h, wires);
-      for (int i = 0; i < phase_expts.size(); i++) {
+      basis.remove(new_h.qubit);
+      for (int i = 0; i < (int)phase_expts.size(); i++) {
         if (phase_expts[i].first != 0) {
-          if (is_indep(n + h, wires, phase_expts[i].second)) new_h.in.insert(i);
+          if (!basis.contains(phase_expts[i].second)) new_h.in.insert(i);
         }
       }
+      basis.assign(new_h.qubit, new_h.prep);
 
-      // Reset the current wire values
+      // Find the hadamards this one depends on. A value prepared by an earlier
+      //   hadamard that still sits alone on its qubit can be prepared at the
+      //   same time as this one, any other use of it is a dependency
+      used.reset();
       for (int i = 0; i < n + m; i++) {
-        wires[i] = new_h.wires[i];
-      }
-      /*
-      wires[new_h.qubit].reset();
-      int rank = compute_rank(n + m, n + h, wires);
-      for (int i = 0; i < phase_expts.size(); i++) {
-        if (phase_expts[i].first != 0) {
-          wires[new_h.qubit] = phase_expts[i].second;
-          if (compute_rank(n + m, n + h, wires) > rank) new_h.in.insert(i);
+        const xor_func & w = wires[i];
+        size_t v = w.find_first();
+        if (v == xor_func::npos || v < (size_t)n || v >= (size_t)(n + h) ||
+            hadamards[v - n].qubit != i || w.find_next(v) != xor_func::npos) {
+          used |= w;
         }
       }
-      */
+      for (set<int>::iterator ti = new_h.in.begin(); ti != new_h.in.end(); ti++) {
+        used |= phase_expts[*ti].second;
+      }
+      if (last_h[new_h.qubit] != -1) used.set(n + last_h[new_h.qubit]);
+      for (size_t v = used.find_first(); v < (size_t)(n + h); v = used.find_next(v)) {
+        if (v >= (size_t)n) new_h.deps.push_back(v - n);
+      }
+      last_h[new_h.qubit] = new_h.prep - n;
+
+      // Start a new stage if it depends on a hadamard of the current one
+      bool indep = !stages.empty();
+      for (int i = 0; indep && i < (int)new_h.deps.size(); i++) {
+        if (new_h.deps[i] >= stages.back()) indep = false;
+      }
+      if (!indep) stages.push_back(hadamards.size());
 
       // Done creating the new hadamard
-      hadamards.push_back(new_h);
+      hadamards.push_back(std::move(new_h));
 
       // Prepare the new value
-      wires[new_h.qubit].reset();
-      wires[new_h.qubit].set(new_h.prep);
+      const Hadamard & last = hadamards.back();
+      wires[last.qubit].reset();
+      wires[last.qubit].set(last.prep);
 
       // Give this new value a name
-      val_map[new_h.prep] = name_max;
-      names[name_max] = names[new_h.qubit];
-      names[name_max++].append(to_string(new_h.prep));
+      val_map[last.prep] = name_max;
+      names[name_max] = names[last.qubit];
+      names[name_max++].append(to_string(last.prep));
 
     } else {
       cout << "ERROR: not a {H, CNOT, X, Y, Z, P, T} circuit\n";
       phase_expts.clear();
+      phase_index.clear();
     }
   }
   //Outputs are all wires until ancilla are added
@@ -610,16 +971,7 @@ void character::add_ancillae(int num) {
   auto new_zero    = vector<bool>(num_qubits);
   auto new_out = vector<xor_func>(num_qubits);
 
-  for (list<Hadamard>::iterator it = hadamards.begin(); it != hadamards.end(); it++) {
-    vector<xor_func> new_wires(num_qubits);
-    for (i = 0; i < num_qubits; i++) {
-      if (i < (n + m)) new_wires[i] = it->wires[i];
-      else new_wires[i] = xor_func(n + h + 1, 0);
-    }
-    it->wires = std::move(new_wires);
-  }
-
-  cout << "num bits: " << num_qubits  << endl;
+  if (disp_log) cerr << "    num bits: " << num_qubits  << "\n" << flush;
   for (i = 0; i < num_qubits; i++) {
     if (i < (n + m)) {
       new_names[i] = names[i];
@@ -642,14 +994,14 @@ void character::add_ancillae(int num) {
 
 void character::remove_x() {
   int i, ind;
-  list<Hadamard>::iterator it;
+  vector<Hadamard>::iterator it;
 
-  for (i = 0; i < phase_expts.size(); i++) {
+  for (i = 0; i < (int)phase_expts.size(); i++) {
     if (phase_expts[i].second.test(n + h)) {
       xor_func tmp = phase_expts[i].second;
       tmp.reset(n + h);
-      insert_phase(phase_expts[i].first, xor_func(n + h + 1, 0), phase_expts);
-      ind = insert_phase((phase_expts[i].first*7) % 8, tmp, phase_expts);
+      insert_phase(phase_expts[i].first, xor_func(n + h + 1, 0), phase_expts, phase_index);
+      ind = insert_phase((phase_expts[i].first*7) % 8, tmp, phase_expts, phase_index);
       for (it = hadamards.begin(); it != hadamards.end(); it++) {
 	      if (it->in.find(i) != it->in.end()) it->in.insert(ind);
       }
@@ -658,119 +1010,297 @@ void character::remove_x() {
   }
 }
 
+// Phase terms that must be applied before the hadamards of stage k. Stages
+//   of more than one hadamard collect them in buf
+const set<int> & character::stage_in(int k, set<int> & buf) {
+  if (stage_end(k) - stages[k] == 1) return hadamards[stages[k]].in;
+
+  buf.clear();
+  for (int i = stages[k]; i < stage_end(k); i++) {
+    buf.insert(hadamards[i].in.begin(), hadamards[i].in.end());
+  }
+  return buf;
+}
+
+// State of the wires right before the hadamards of stage k, given the state
+//   after the previous stage. The gates between the hadamards of a stage
+//   leave the others' qubits alone, so they keep what they held before
+void character::stage_wires(int k, const vector<xor_func> & wires, vector<xor_func> & target) {
+  target = wires;
+  for (int i = stages[k]; i < stage_end(k); i++) {
+    const gatelist & delta = hadamards[i].delta;
+    for (gatelist::const_iterator it = delta.begin(); it != delta.end(); it++) {
+      if (it->arity == 2) target[it->args[1]] ^= target[it->args[0]];
+      else target[it->args[0]].flip(n + h);
+    }
+  }
+}
+
+// The hadamard preparing the last value f needs, or -1 if it only needs
+//   the inputs. Values are numbered in the order they are prepared, and the
+//   stages apply the hadamards in order, so f can be computed once that
+//   hadamard's stage is done
+int character::ready_after(const xor_func & f) {
+  int ret = -1;
+  for (size_t v = f.find_first(); v < (size_t)(n + h); v = f.find_next(v)) {
+    if (v >= (size_t)n) ret = v - n;
+  }
+  return ret;
+}
+
 //---------------------------- Synthesis
 
-dotqc character::synthesize() {
+// Number of CNOTs lst is left with after post-processing, and its depth on
+//   num qubits. Swaps only cost anything once at the end of the whole
+//   circuit, so are left out
+static void measure(const gatelist & lst, int num, int & cnot, int & depth) {
+  dotqc tmp;
+  vector<int> level(num, 0);
+
+  tmp.names.resize(num);
+  tmp.circ = lst;
+  tmp.remove_swaps(false);
+  tmp.remove_ids();
+  cnot = depth = 0;
+  for (gatelist::const_iterator it = tmp.circ.begin(); it != tmp.circ.end(); it++) {
+    int d = 0;
+    if (it->type == GATE_TOF && it->arity == 2) cnot++;
+    for (int i = 0; i < it->arity; i++) d = max(d, level[it->args[i]] + 1);
+    for (int i = 0; i < it->arity; i++) level[it->args[i]] = d;
+    depth = max(depth, d);
+  }
+}
+
+// construct_circuit, except that BEST constructs the circuit with every
+//   method, at the same time if there is a pool, and keeps the one with the
+//   fewest CNOTs, then the least depth. Each method works on its own copy of
+//   in, which ends up the same echelon form whichever is kept. The method
+//   used is counted in synth_tally
+static gatelist construct_block(
+    const vector<exponent> & phase,
+    const partitioning & part,
+    vector<xor_func>& in,
+    const vector<xor_func>& out,
+    int num,
+    int dim) {
+  const synth_type methods[NUM_SYNTH_METHODS] = { AD_HOC, GAUSS, PMH };
+  vector<xor_func> wires[NUM_SYNTH_METHODS];
+  gatelist circ[NUM_SYNTH_METHODS];
+  int cnot[NUM_SYNTH_METHODS], depth[NUM_SYNTH_METHODS];
+  thread_pool * pool = (job_pool != NULL && job_pool->size() > 1) ? job_pool : NULL;
+  task_group group;
+  int best = 0;
+
+  if (synth_method != BEST) {
+    if (synth_tally != NULL) synth_tally->wins[synth_method]++;
+    return construct_circuit(phase, part, in, out, num, dim);
+  }
+
+  auto run = [&](int c) {
+    synth_type saved = synth_method;
+    synth_method = methods[c];
+    wires[c] = in;
+    circ[c] = construct_circuit(phase, part, wires[c], (&in == &out) ? wires[c] : out, num, dim);
+    measure(circ[c], num, cnot[c], depth[c]);
+    synth_method = saved;
+  };
+  for (int c = 1; c < NUM_SYNTH_METHODS; c++) {
+    if (pool != NULL) pool->submit([&run, c] { run(c); }, &group);
+    else run(c);
+  }
+  run(0);
+  if (pool != NULL) pool->wait(group);
+
+  for (int c = 1; c < NUM_SYNTH_METHODS; c++) {
+    if (cnot[c] < cnot[best] || (cnot[c] == cnot[best] && depth[c] < depth[best])) best = c;
+  }
+  if (synth_tally != NULL) synth_tally->wins[best]++;
+  in = std::move(wires[best]);
+  return std::move(circ[best]);
+}
+
+// A stage's {CNOT, T} subcircuit depends only on its frozen partitions and
+//   the wires before and after it, so can be synthesized while later stages
+//   are partitioned
+struct stage_job {
+  int k;
+  partitioning frozen[2];
+  vector<xor_func> wires, target;
+  gatelist circ;
+  task_group group;
+};
+
+// If out is given, the circuit is written out up to each Hadamard as soon
+//   as it is synthesized, and only the remainder is returned. With a pool
+//   of several threads, stages are synthesized on it in the background
+dotqc character::synthesize(qc_writer * out) {
   auto floats = vector<partitioning>(2);
-  auto frozen = vector<partitioning>(2);
+  deque<stage_job> jobs;                // Stages being synthesized, in order
+  thread_pool * pool = (job_pool != NULL && job_pool->size() > 1) ? job_pool : NULL;
+  synth_type method = synth_method;
+  synth_wins * tally = synth_tally;
+  thread_pool * workers = job_pool;
   dotqc ret;
-  xor_func mask(n + h + 1, 0);      // Tells us what values we have prepared
   vector<xor_func> wires(n + m);        // Current state of the wires
-  vector<list<int> > remaining(2);          // Which terms we still have to partition
-  int dim = n, tmp, h_count = 1, applied = 0, j;
+  vector<xor_func> target(n + m);       // State of the wires before each stage
+  set<int> buf;                         // Terms to apply before each stage
+  vector<vector<int> > ready[2];        // Terms to partition, by ready_after + 1
+  vector<int> fresh;                    // Terms ready after the current stage
+  int waiting = 0;                      // Terms still to partition
+  int dim = n, tmp, k, applied = 0, j;
   ind_oracle oracle(n + m, dim, n + h);
-  list<pair<string, list<string> > > circ;
-  list<Hadamard>::iterator it;
   int global_phase = 0;
+  int used = 0, needed = 0;             // Partitions made, and a lower bound
 
   // initialize some stuff
   ret.n = n;
   ret.m = m;
-  mask.set(n + h);
   for (int i = 0, j = 0; i < n + m; i++) {
     ret.names.push_back(names[i]);
-    ret.zero[names[i]] = zero[i];
+    ret.zero.push_back(zero[i]);
     wires[i] = xor_func(n + h + 1, 0);
-    if (!zero[i]) {
-      wires[i].set(j);
-      mask.set(j++);
-    }
+    if (!zero[i]) wires[i].set(j++);
   }
+  if (out != NULL) out->header(ret);
 
-  // initialize the remaining list
-  for (int i = 0; i < phase_expts.size(); i++) {
+  // bucket the terms to partition
+  ready[0].resize(h + 1);
+  ready[1].resize(h + 1);
+  for (int i = 0; i < (int)phase_expts.size(); i++) {
     if (phase_expts[i].second == xor_func(n + h + 1, 0)) global_phase = phase_expts[i].first;
-    else if (phase_expts[i].first % 2 == 1) remaining[0].push_back(i);
-    else if (phase_expts[i].first != 0) remaining[1].push_back(i);
+    else if (phase_expts[i].first % 2 == 1) ready[0][ready_after(phase_expts[i].second) + 1].push_back(i);
+    else if (phase_expts[i].first != 0) ready[1][ready_after(phase_expts[i].second) + 1].push_back(i);
+    else continue;
+    waiting++;
   }
 
   // create an initial partition
   // cerr << "Adding new functions to the partition... " << flush;
   for (j = 0; j < 2; j++) {
-    for (list<int>::iterator it = remaining[j].begin(); it != remaining[j].end();) {
-      xor_func tmp = (~mask) & (phase_expts[*it].second);
-      if (tmp.none()) {
-        add_to_partition(floats[j], *it, phase_expts, oracle);
-        it = remaining[j].erase(it);
-      } else it++;
+    for (int i = 0; i < (int)ready[j][0].size(); i++) {
+      add_to_partition(floats[j], ready[j][0][i], phase_expts, oracle);
+      waiting--;
     }
   }
-  if (disp_log) cerr << "  " << phase_expts.size() - (remaining[0].size() + remaining[1].size())
+  if (disp_log) cerr << "  " << phase_expts.size() - waiting
     << "/" << phase_expts.size() << " phase rotations partitioned\n" << flush;
 
-  for (it = hadamards.begin(); it != hadamards.end(); it++, h_count++) {
-    // 1. freeze partitions that are not disjoint from the hadamard input
+  // Synthesis runs on whichever thread picks it up, so takes the method,
+  //   tally and pool along
+  auto build = [this, method, tally, workers](stage_job * job) {
+    synth_type saved = synth_method;
+    synth_wins * saved_tally = synth_tally;
+    thread_pool * saved_pool = job_pool;
+    synth_method = method;
+    synth_tally = tally;
+    job_pool = workers;
+    job->circ = construct_block(phase_expts, job->frozen[0], job->wires, job->wires, n + m, n + h);
+    append(job->circ,
+        construct_block(phase_expts, job->frozen[1], job->wires, job->target, n + m, n + h));
+    synth_method = saved;
+    synth_tally = saved_tally;
+    job_pool = saved_pool;
+  };
+  // Add the oldest stage to the circuit, followed by its Hadamard gates
+  auto finish = [&]() {
+    stage_job & job = jobs.front();
+    if (pool != NULL) pool->wait(job.group);
+    append(ret.circ, job.circ);
+    for (int i = stages[job.k]; i < stage_end(job.k); i++) {
+      ret.circ.push_back(gate(GATE_H, hadamards[i].qubit));
+    }
+    if (out != NULL) out->stream(ret);
+    jobs.pop_front();
+  };
+
+  for (k = 0; k < (int)stages.size(); k++) {
+    // 1. freeze partitions that are not disjoint from the stage's input
     // 2.construct CNOT+T circuit
-    // 3. apply the hadamard gate
+    // 3. apply the hadamard gates
     // 4. add new functions to the partition
-    if (disp_log) cerr << "  Hadamard " << h_count << "/" << hadamards.size() << "\n" << flush;
+    if (disp_log) cerr << "  Hadamard stage " << k + 1 << "/" << stages.size()
+      << " (" << stage_end(k) - stages[k] << " hadamard(s))\n" << flush;
 
     // determine frozen partitions
+    const set<int> & in = stage_in(k, buf);
+    stage_job & job = jobs.emplace_back();
+    job.k = k;
     for (j = 0; j < 2; j++) {
-      frozen[j] = freeze_partitions(floats[j], it->in);
-      applied += num_elts(frozen[j]);
+      job.frozen[j] = freeze_partitions(floats[j], in);
+      applied += num_elts(job.frozen[j]);
+      // A partition holds at most one term per qubit
+      used += job.frozen[j].size();
+      needed += (num_elts(job.frozen[j]) + n + m - 1) / (n + m);
     }
 
     // Construct {CNOT, T} subcircuit for the frozen partitions
-    ret.circ.splice(ret.circ.end(),
-        construct_circuit(phase_expts, frozen[0], wires, wires, n + m, n + h, names));
-    ret.circ.splice(ret.circ.end(),
-        construct_circuit(phase_expts, frozen[1], wires, it->wires, n + m, n + h, names));
-    for (int i = 0; i < n + m; i++) {
-      wires[i] = it->wires[i];
-    }
+    stage_wires(k, wires, target);
+    job.wires = wires;
+    job.target = target;
+    if (pool != NULL) pool->submit([&build, &job] { build(&job); }, &job.group);
+    else build(&job);
+    swap(wires, target);
     if (disp_log) cerr << "    " << applied << "/" << phase_expts.size() << " phase rotations applied\n" << flush;
 
-    // Apply Hadamard gate
-    ret.circ.push_back(make_pair("H", list<string>(1, names[it->qubit])));
-    wires[it->qubit].reset();
-    wires[it->qubit].set(it->prep);
-    mask.set(it->prep);
+    // Apply Hadamard gates
+    for (int i = stages[k]; i < stage_end(k); i++) {
+      const Hadamard & had = hadamards[i];
+      wires[had.qubit].reset();
+      wires[had.qubit].set(had.prep);
+    }
+
+    // Collect the stages done so far, and don't get too far ahead
+    while (!jobs.empty() && (pool == NULL || jobs.front().group.pending == 0)) finish();
+    while (pool != NULL && (int)jobs.size() > 2 * pool->size()) finish();
 
-    // Check for increases in dimension
+    // Check for increases in dimension. Repartitioning fixes an increase of
+    //   one, so a stage that adds several dimensions goes one at a time
     tmp = compute_rank(n + m, n + h, wires);
     if (tmp > dim) {
       if (disp_log) cerr << "    Dimension increased to " << tmp << ", fixing partitions...\n" << flush;
-      dim = tmp;
-      oracle.set_dim(dim);
-      repartition(floats[0], phase_expts, oracle);
-      repartition(floats[1], phase_expts, oracle);
+      while (dim < tmp) {
+        oracle.set_dim(++dim);
+        repartition(floats[0], phase_expts, oracle);
+        repartition(floats[1], phase_expts, oracle);
+      }
     }
 
-    // Add new functions to the partition
+    // Add new functions to the partition, in order
     for (j = 0; j < 2; j++) {
-      for (list<int>::iterator it = remaining[j].begin(); it != remaining[j].end();) {
-        xor_func tmp = (~mask) & (phase_expts[*it].second);
-        if (tmp.none()) {
-          add_to_partition(floats[j], *it, phase_expts, oracle);
-          it = remaining[j].erase(it);
-        } else it++;
+      fresh.clear();
+      for (int i = stages[k]; i < stage_end(k); i++) {
+        fresh.insert(fresh.end(), ready[j][i + 1].begin(), ready[j][i + 1].end());
+      }
+      sort(fresh.begin(), fresh.end());
+      for (int i = 0; i < (int)fresh.size(); i++) {
+        add_to_partition(floats[j], fresh[i], phase_expts, oracle);
+        waiting--;
       }
     }
-    if (disp_log) cerr << "    " << phase_expts.size() - (remaining[0].size() + remaining[1].size())
+    if (disp_log) cerr << "    " << phase_expts.size() - waiting
       << "/" << phase_expts.size() << " phase rotations partitioned\n" << flush;
   }
 
+  while (!jobs.empty()) finish();
   applied += num_elts(floats[0]) + num_elts(floats[1]);
+  for (j = 0; j < 2; j++) {
+    used += floats[j].size();
+    needed += (num_elts(floats[j]) + n + m - 1) / (n + m);
+  }
   // Construct the final {CNOT, T} subcircuit
-  ret.circ.splice(ret.circ.end(),
-      construct_circuit(phase_expts, floats[0], wires, wires, n + m, n + h, names));
-  ret.circ.splice(ret.circ.end(),
-      construct_circuit(phase_expts, floats[1], wires, outputs, n + m, n + h, names));
-  if (disp_log) cerr << "  " << applied << "/" << phase_expts.size() << " phase rotations applied\n" << flush;
+  append(ret.circ,
+        construct_block(phase_expts, floats[0], wires, wires, n + m, n + h));
+  append(ret.circ,
+        construct_block(phase_expts, floats[1], wires, outputs, n + m, n + h));
+  layers_used = used;
+  layers_needed = needed;
+  if (disp_log) cerr << "  " << applied << "/" << phase_expts.size() << " phase rotations applied\n"
+    << "  " << used << " partitions used, at least " << needed << " needed\n"
+    << "  " << oracle.memo_hits() << " independence tests remembered, "
+    << oracle.memo_misses() << " worked out\n" << flush;
 
   // Add the global phase
-  ret.circ.splice(ret.circ.end(), global_phase_synth(n + m, global_phase, names));
+  append(ret.circ, global_phase_synth(n + m, global_phase));
 
   return ret;
 }
@@ -778,62 +1308,67 @@ dotqc character::synthesize() {
 dotqc character::synthesize_unbounded() {
   partitioning floats[2], frozen[2];
   dotqc ret;
-  xor_func mask(n + h + 1, 0);      // Tells us what values we have prepared
   auto wires = vector<xor_func>(n + m); // Current state of the wires
-  list<int> remaining[2];          // Which terms we still have to partition
-  int dim = n, tmp1, tmp2, h_count = 1, applied = 0, j;
+  vector<xor_func> target(n + m);       // State of the wires before each stage
+  set<int> buf;                         // Terms to apply before each stage
+  vector<vector<int> > ready[2];        // Terms to partition, by ready_after + 1
+  vector<int> fresh;                    // Terms ready after the current stage
+  int waiting = 0;                      // Terms still to partition
+  int dim = n, tmp1, tmp2, k, applied = 0, j;
   ind_oracle oracle(n + m, dim, n + h);
-  list<pair<string, list<string> > > circ;
-  list<Hadamard>::iterator it;
   int global_phase = 0;
+  int used = 0, needed = 0;             // Partitions made, and a lower bound
 
   // initialize some stuff
-  mask.set(n + h);
   for (int i = 0, j = 0; i < n + m; i++) {
     wires[i] = xor_func(n + h + 1, 0);
-    if (!zero[i]) {
-      wires[i].set(j);
-      mask.set(j++);
-    }
+    if (!zero[i]) wires[i].set(j++);
   }
 
-  // initialize the remaining list
-  for (int i = 0; i < phase_expts.size(); i++) {
+  // bucket the terms to partition
+  ready[0].resize(h + 1);
+  ready[1].resize(h + 1);
+  for (int i = 0; i < (int)phase_expts.size(); i++) {
     if (phase_expts[i].second == xor_func(n + h + 1, 0)) global_phase = phase_expts[i].first;
-    if (phase_expts[i].first % 2 == 1) remaining[0].push_back(i);
-    else if (phase_expts[i].first != 0) remaining[1].push_back(i);
+    if (phase_expts[i].first % 2 == 1) ready[0][ready_after(phase_expts[i].second) + 1].push_back(i);
+    else if (phase_expts[i].first != 0) ready[1][ready_after(phase_expts[i].second) + 1].push_back(i);
+    else continue;
+    waiting++;
   }
 
   // create an initial partition
   // cerr << "Adding new functions to the partition... " << flush;
   for (j = 0; j < 2; j++) {
-    for (list<int>::iterator it = remaining[j].begin(); it != remaining[j].end();) {
-      xor_func tmp = (~mask) & (phase_expts[*it].second);
-      if (tmp.none()) {
-        if (floats[j].size() == 0) floats[j].push_back(set<int>());
-        (floats[j].begin())->insert(*it);
-        it = remaining[j].erase(it);
-      } else it++;
+    for (int i = 0; i < (int)ready[j][0].size(); i++) {
+      if (floats[j].size() == 0) floats[j].push_front();
+      floats[j].insert(floats[j].slot(0), ready[j][0][i]);
+      waiting--;
     }
   }
-  if (disp_log) cerr << "  " << phase_expts.size() - (remaining[0].size() + remaining[1].size())
+  if (disp_log) cerr << "  " << phase_expts.size() - waiting
     << "/" << phase_expts.size() << " phase rotations partitioned\n" << flush;
 
-  for (it = hadamards.begin(); it != hadamards.end(); it++, h_count++) {
-    // 1. freeze partitions that are not disjoint from the hadamard input
+  for (k = 0; k < (int)stages.size(); k++) {
+    // 1. freeze partitions that are not disjoint from the stage's input
     // 2. construct CNOT+T circuit
-    // 3. apply the hadamard gate
+    // 3. apply the hadamard gates
     // 4. add new functions to the partition
-    if (disp_log) cerr << "  Hadamard " << h_count << "/" << hadamards.size() << "\n" << flush;
+    if (disp_log) cerr << "  Hadamard stage " << k + 1 << "/" << stages.size()
+      << " (" << stage_end(k) - stages[k] << " hadamard(s))\n" << flush;
 
     tmp1 = compute_rank(n + m, n + h, wires);
     // determine frozen partitions
+    const set<int> & in = stage_in(k, buf);
     for (j = 0; j < 2; j++) {
-      frozen[j] = freeze_partitions(floats[j], it->in);
+      frozen[j] = freeze_partitions(floats[j], in);
       applied += num_elts(frozen[j]);
+      // Ancillae are added until the terms fit in one partition, which is
+      //   also the least a non-empty group can take
+      used += frozen[j].size();
+      needed += frozen[j].size() != 0;
       // determine if we need to add ancillae
       if (frozen[j].size() != 0) {
-        tmp2 = compute_rank(n + h, phase_expts, *(frozen[j].begin()));
+        tmp2 = compute_rank(n + h, phase_expts, frozen[j][0]);
         int etc = ((tmp1 - tmp2 < 0)?tmp1:tmp1 - tmp2) + num_elts(frozen[j]) - n - m;
         if (etc > 0) {
           for (int i = 0; i < etc; i++) {
@@ -846,86 +1381,111 @@ dotqc character::synthesize_unbounded() {
 
     if (disp_log) cerr << "    Synthesizing T-layer\n" << flush;
     // Construct {CNOT, T} subcircuit for the frozen partitions
-    ret.circ.splice(ret.circ.end(),
-        construct_circuit(phase_expts, frozen[0], wires, wires, n + m, n + h, names));
-    ret.circ.splice(ret.circ.end(),
-        construct_circuit(phase_expts, frozen[1], wires, it->wires, n + m, n + h, names));
-    for (int i = 0; i < n + m; i++) {
-      wires[i] = it->wires[i];
-    }
+    stage_wires(k, wires, target);
+    append(ret.circ,
+        construct_block(phase_expts, frozen[0], wires, wires, n + m, n + h));
+    append(ret.circ,
+        construct_block(phase_expts, frozen[1], wires, target, n + m, n + h));
+    swap(wires, target);
     if (disp_log) cerr << "    " << applied << "/" << phase_expts.size() << " phase rotations applied\n" << flush;
 
-    // Apply Hadamard gate
-    ret.circ.push_back(make_pair("H", list<string>(1, names[it->qubit])));
-    wires[it->qubit].reset();
-    wires[it->qubit].set(it->prep);
-    mask.set(it->prep);
+    // Apply Hadamard gates
+    for (int i = stages[k]; i < stage_end(k); i++) {
+      const Hadamard & had = hadamards[i];
+      ret.circ.push_back(gate(GATE_H, had.qubit));
+      wires[had.qubit].reset();
+      wires[had.qubit].set(had.prep);
+    }
 
     // Add new functions to the partition
     for (j = 0; j < 2; j++) {
-      for (list<int>::iterator it = remaining[j].begin(); it != remaining[j].end();) {
-        xor_func tmp = (~mask) & (phase_expts[*it].second);
-        if (tmp.none()) {
-          if (floats[j].size() == 0) floats[j].push_back(set<int>());
-          (floats[j].begin())->insert(*it);
-          it = remaining[j].erase(it);
-        } else it++;
+      for (int i = stages[k]; i < stage_end(k); i++) {
+        for (int t = 0; t < (int)ready[j][i + 1].size(); t++) {
+          if (floats[j].size() == 0) floats[j].push_front();
+          floats[j].insert(floats[j].slot(0), ready[j][i + 1][t]);
+          waiting--;
+        }
       }
     }
-    if (disp_log) cerr << "    " << phase_expts.size() - (remaining[0].size() + remaining[1].size())
+    if (disp_log) cerr << "    " << phase_expts.size() - waiting
       << "/" << phase_expts.size() << " phase rotations partitioned\n" << flush;
   }
 
   applied += num_elts(floats[0]) + num_elts(floats[1]);
+  for (j = 0; j < 2; j++) {
+    used += floats[j].size();
+    needed += floats[j].size() != 0;
+  }
+  layers_used = used;
+  layers_needed = needed;
   // Construct the final {CNOT, T} subcircuit
 
   // determine if we need to add ancillae
   tmp1 = compute_rank(n + m, n + h, wires);
   for (j = 0; j < 2; j++) {
     if (floats[j].size() != 0) {
-      for (j = 0; j < 2; j++) {
-        tmp2 = compute_rank(n + h, phase_expts, *(floats[j].begin()));
-        int etc = tmp1 - tmp2 + num_elts(floats[j]) - n - m;
-        if (etc > 0) {
-          if (disp_log) cerr << "    " << "Adding " << etc << " ancilla(e)\n" << flush;
-          vector<xor_func> tmp(n + m + etc);
-          for (int i = 0; i < n + m + etc; i++) {
-            if (i < n + m) tmp[i] = wires[i];
-            else tmp[i] = xor_func(n + h + 1, 0);
-          }
-          wires = std::move(tmp);
-          add_ancillae(etc);
+      tmp2 = compute_rank(n + h, phase_expts, floats[j][0]);
+      int etc = tmp1 - tmp2 + num_elts(floats[j]) - n - m;
+      if (etc > 0) {
+        if (disp_log) cerr << "    " << "Adding " << etc << " ancilla(e)\n" << flush;
+        vector<xor_func> tmp(n + m + etc);
+        for (int i = 0; i < n + m + etc; i++) {
+          if (i < n + m) tmp[i] = wires[i];
+          else tmp[i] = xor_func(n + h + 1, 0);
         }
+        wires = std::move(tmp);
+        add_ancillae(etc);
       }
     }
   }
 
-  ret.circ.splice(ret.circ.end(),
-      construct_circuit(phase_expts, floats[0], wires, wires, n + m, n + h, names));
-  ret.circ.splice(ret.circ.end(),
-      construct_circuit(phase_expts, floats[1], wires, outputs, n + m, n + h, names));
-  if (disp_log) cerr << "  " << applied << "/" << phase_expts.size() << " phase rotations applied\n" << flush;
+  append(ret.circ,
+        construct_block(phase_expts, floats[0], wires, wires, n + m, n + h));
+  append(ret.circ,
+        construct_block(phase_expts, floats[1], wires, outputs, n + m, n + h));
+  if (disp_log) cerr << "  " << applied << "/" << phase_expts.size() << " phase rotations applied\n"
+    << "  " << used << " partitions used, at least " << needed << " needed\n"
+    << "  " << oracle.memo_hits() << " independence tests remembered, "
+    << oracle.memo_misses() << " worked out\n" << flush;
 
   ret.n = n;
   ret.m = m;
   for (int i = 0; i < n + m; i++) {
     ret.names.push_back(names[i]);
-    ret.zero[names[i]] = zero[i];
+    ret.zero.push_back(zero[i]);
   }
 
   // Add the global phase
-  ret.circ.splice(ret.circ.end(), global_phase_synth(n + m, global_phase, names));
+  append(ret.circ, global_phase_synth(n + m, global_phase));
 
   return ret;
 }
 
 //-------------------------------- old {CNOT, T} version code. Still used for the "no hadamards" option
 
+// Finish a subcircuit: every qubit that is still zero at the start of the
+//   subcircuit is added as an ancilla, in order of name
+void close_subcircuit(dotqc & acc, vector<int> & local, const vector<bool> & zero_start,
+    const vector<string> & names, const vector<int> & order) {
+  acc.n = acc.m = 0;
+  for (int i = 0; i < (int)order.size(); i++) {
+    int q = order[i];
+    if (zero_start[q]) {
+      acc.m += 1;
+      if (local[q] == -1) {
+        local[q] = acc.names.size();
+        acc.names.push_back(names[q]);
+        acc.zero.push_back(true);
+      }
+    }
+  }
+  acc.n = acc.names.size() - acc.m;
+}
+
 void metacircuit::partition_dotqc(dotqc & input) {
-  list<pair<string, list<string> > >::iterator it;
-  list<string>::iterator iti;
-  map<string, bool>::iterator ti;
+  gatelist::iterator it;
   circuit_type current = UNKNOWN;
+  vector<int> order = name_order(input.names);
 
   n = input.n;
   m = input.m;
@@ -934,68 +1494,49 @@ void metacircuit::partition_dotqc(dotqc & input) {
   zero  = input.zero;
 
   dotqc acc;
-  map<string, bool> zero_acc = input.zero;
+  vector<bool> zero_acc = input.zero;  // which qubits are still zero
+  vector<bool> zero_start = zero_acc;  // which qubits were zero when acc was started
+  vector<int> local(names.size(), -1); // index of each qubit in acc, or -1
 
-  acc.zero = zero_acc;
   for (it = input.circ.begin(); it != input.circ.end(); it++) {
-    if ((it->first == "T"   && it->second.size() == 1) ||
-        (it->first == "T*"  && it->second.size() == 1) ||
-        (it->first == "P"   && it->second.size() == 1) ||
-        (it->first == "P*"  && it->second.size() == 1) ||
-        (it->first == "X"   && it->second.size() == 1) ||
-        (it->first == "Y"   && it->second.size() == 1) ||
-        (it->first == "Z"   && (it->second.size() == 1 || it->second.size() == 3)) ||
-        (it->first == "tof" && (it->second.size() == 1 || it->second.size() == 2))) {
-      if (current == UNKNOWN) {
-        current = CNOTT;
-      } else if (current != CNOTT) {
-        acc.n = acc.m = 0;
-        for (ti = acc.zero.begin(); ti != acc.zero.end(); ti++) {
-          if (ti->second) {
-            acc.m += 1;
-            if (!find_name(acc.names, ti->first)) acc.names.push_back(ti->first);
-          }
-        }
-        acc.n = acc.names.size() - acc.m;
-        circuit_list.push_back(make_pair(current, acc));
-
-        acc.clear();
-        acc.zero = zero_acc;
-        current = CNOTT;
-      }
-    } else {
-      if (current == UNKNOWN) {
-        current = OTHER;
-      } else if (current != OTHER) {
-        acc.n = acc.m = 0;
-        for (ti = acc.zero.begin(); ti != acc.zero.end(); ti++) {
-          if (ti->second) {
-            acc.m += 1;
-            if (!find_name(acc.names, ti->first)) acc.names.push_back(ti->first);
-          }
-        }
-        acc.n = acc.names.size() - acc.m;
-        circuit_list.push_back(make_pair(current, acc));
-
-        acc.clear();
-        acc.zero = zero_acc;
-        current = OTHER;
-      }
+    circuit_type type = OTHER;
+    if ((it->type == GATE_T    && it->arity == 1) ||
+        (it->type == GATE_TDAG && it->arity == 1) ||
+        (it->type == GATE_P    && it->arity == 1) ||
+        (it->type == GATE_PDAG && it->arity == 1) ||
+        (it->type == GATE_X    && it->arity == 1) ||
+        (it->type == GATE_Y    && it->arity == 1) ||
+        (it->type == GATE_Z    && (it->arity == 1 || it->arity == 3)) ||
+        (it->type == GATE_TOF  && (it->arity == 1 || it->arity == 2))) {
+      type = CNOTT;
     }
-    for (iti = it->second.begin(); iti != it->second.end(); iti++) {
-      zero_acc[*iti] = false;
+    if (current == UNKNOWN) {
+      current = type;
+    } else if (current != type) {
+      close_subcircuit(acc, local, zero_start, names, order);
+      circuit_list.push_back(make_pair(current, acc));
+
+      acc.clear();
+      zero_start = zero_acc;
+      local.assign(names.size(), -1);
+      current = type;
     }
-    acc.append(*it);
-  }
 
-  acc.n = acc.m = 0;
-  for (ti = acc.zero.begin(); ti != acc.zero.end(); ti++) {
-    if (ti->second) {
-      acc.m += 1;
-      if (!find_name(acc.names, ti->first)) acc.names.push_back(ti->first);
+    // Add the gate to the subcircuit, relabelling its qubits
+    int * args = acc.add_gate(*it, input.args_of(*it));
+    for (int i = 0; i < it->arity; i++) {
+      int q = args[i];
+      zero_acc[q] = false;
+      if (local[q] == -1) {
+        local[q] = acc.names.size();
+        acc.names.push_back(names[q]);
+        acc.zero.push_back(zero_start[q]);
+      }
+      args[i] = local[q];
     }
   }
-  acc.n = acc.names.size() - acc.m;
+
+  close_subcircuit(acc, local, zero_start, names, order);
   circuit_list.push_back(make_pair(current, acc));
 }
 
@@ -1018,14 +1559,24 @@ dotqc metacircuit::to_dotqc() {
   dotqc ret;
   list<pair<circuit_type, dotqc> >::iterator it;
   gatelist::iterator ti;
+  map<string, int> name_map;
+  vector<int> global;
   ret.n = n;
   ret.m = m;
   ret.names = names;
   ret.zero = zero;
 
+  for (int i = 0; i < (int)names.size(); i++) name_map[names[i]] = i;
+
   for (it = circuit_list.begin(); it != circuit_list.end(); it++) {
+    // Map the subcircuit's qubits back to the qubits of the full circuit
+    global.resize(it->second.names.size());
+    for (int i = 0; i < (int)it->second.names.size(); i++) {
+      global[i] = name_map[it->second.names[i]];
+    }
     for (ti = it->second.circ.begin(); ti != it->second.circ.end(); ti++) {
-      ret.circ.push_back(*ti);
+      int * args = ret.add_gate(*ti, it->second.args_of(*ti));
+      for (int i = 0; i < ti->arity; i++) args[i] = global[args[i]];
     }
   }
 
@@ -1034,11 +1585,16 @@ dotqc metacircuit::to_dotqc() {
 
 void metacircuit::optimize() {
   list<pair<circuit_type, dotqc> >::iterator it;
+  int used = 0, needed = 0;
   for (it =circuit_list.begin(); it != circuit_list.end(); it++) {
     if (it->first == CNOTT) {
       character tmp;
       tmp.parse_circuit(it->second);
       it->second = tmp.synthesize();
+      used += tmp.layers_used;
+      needed += tmp.layers_needed;
     }
   }
+  if (disp_log) cerr << "In all, " << used << " partitions used, at least "
+    << needed << " needed\n" << flush;
 }
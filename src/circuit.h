@@ -24,40 +24,110 @@ Author: Matthew Amy
 #include <iostream>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <cstring>
 #include "matroid.h"
 #include "util.h"
 
+#ifndef CIRCUIT
+#define CIRCUIT
+
 using namespace std;
 
 // Recognized gates are T, T*, P, P*, Z, Z*, Z a b c, tof a b, tof a, X, H
 
+// File formats: textual .qc, or binary .qcb
+enum qc_format { QC, QCB };
+
+// Statistics of a circuit, gathered one gate at a time
+struct qc_stats {
+  int H, cnot, X, T, P, Z;
+  int tdepth;              // T-depth by partitions
+  int used;                // number of qubits used
+  bool tlayer;             // whether the last gate was part of a T layer
+  vector<bool> qubits;     // which qubits have been used
+  vector<int> depth;       // length of the critical path ending at each qubit
+  vector<int> t_depth;     // T-depth of the critical path ending at each qubit
+
+  qc_stats(int num);
+  void add(const gate & g, const int * args);
+  void print(ostream& out);
+};
+
 // Internal representation of a .qc circuit circuit
 struct dotqc {
   int n;                   // number of unknown inputs
   int m;                   // number of known inputs (initialized to |0>)
-  list<string> names;      // names of qubits
-  map<string, bool> zero;  // mapping from qubits to 0 (non-zero) or 1 (zero)
+  vector<string> names;    // names of qubits, indexed by the qubits of circ
+  vector<bool> zero;       // mapping from qubits to 0 (non-zero) or 1 (zero)
   gatelist circ;           // Circuit
-
-  void input(istream& in);
-  void output(ostream& out);
-  void print() {output(cout);}
-  void clear() {n = 0; m = 0; names.clear(); zero.clear(); circ.clear();}
-  void append(pair<string, list<string> > gate);
-  void remove_swaps();
+  vector<int> wide_args;   // qubits of the gates on more than MAX_GATE_ARITY qubits
+
+  // Qubits a gate of the circuit acts on
+  const int * args_of(const gate & g) const { return g.wide() ? &wide_args[g.args[0]] : g.args; }
+  int * args_of(gate & g) { return g.wide() ? &wide_args[g.args[0]] : g.args; }
+  // Appends a gate acting on the qubits args, returning where they are kept
+  int * add_gate(const gate & g, const int * args);
+
+  // Reading stops the program on errors, unless done with read
+  void input(istream& in, qc_format fmt = QC);
+  void input(const string & path, qc_format fmt = QC);
+  bool read(istream& in, qc_format fmt, string & err);
+  bool read(const string & path, qc_format fmt, string & err);
+  bool input_mmap(int fd, qc_format fmt, string & err);
+  bool decode(const char * pos, const char * end, qc_format fmt, string & err);
+  bool read_qc(const char * pos, const char * end, string & err);
+  bool read_qcb(const char * pos, const char * end, string & err);
+  void output(ostream& out, qc_format fmt = QC);
+  void print(qc_format fmt = QC);
+  void clear() {n = 0; m = 0; names.clear(); zero.clear(); circ.clear(); wide_args.clear();}
+  // Swaps become relabelings of the qubits, which unless fix is cleared
+  //   are undone at the end
+  void remove_swaps(bool fix = true);
   int count_depth();
   int count_t_depth();
-  void print_stats();
+  qc_stats stats();
+  void print_stats(ostream& out = cout);
   void remove_ids();
 };
 
+// Buffered .qc/.qcb writer. Gates are serialized into a preallocated buffer
+//   which goes out with a single write whenever it fills up
+class qc_writer {
+  private:
+    qc_format fmt;
+    int fd;
+    ostream * os;
+    vector<char> buf;
+    size_t len;
+
+    void put(const char * s, size_t n);
+    void put(const char * s) { put(s, strlen(s)); }
+    void put(const string & s) { put(s.data(), s.size()); }
+    void put(char c) { if (len == buf.size()) flush(); buf[len++] = c; }
+    void put_varint(unsigned long x);
+  public:
+    qc_stats stats;  // statistics of the gates written so far
+
+    qc_writer(int fdin, qc_format fmtin = QC, size_t size = 1 << 20);
+    qc_writer(ostream& out, qc_format fmtin = QC, size_t size = 1 << 20);
+    ~qc_writer() { flush(); }
+
+    void header(const dotqc & qc);
+    void gates(const dotqc & qc);
+    void footer();
+    void stream(dotqc & qc);
+    void flush();
+};
+
 // ------------------------- Hadamard version
 struct Hadamard {
   int qubit;        // Which qubit this hadamard is applied to
   int prep;         // Which "value" this hadamard prepares
 
   set<int> in;      // exponent terms that must be prepared before the hadamard
-  vector<xor_func> wires; // state of the wires when this hadamard is applied
+  vector<int> deps; // hadamards whose values must be prepared before this one
+  gatelist delta;   // CNOT and X gates applied to the wires since the last hadamard
 };
 
 // Characteristic of a circuit
@@ -69,16 +139,27 @@ struct character {
   vector<bool>       zero;      // Which qubits start as 0
   map<int, int>      val_map;   // which value corresponds to which qubit
   vector<exponent> phase_expts; // a list of exponents of \omega in the mapping
+  unordered_map<xor_func, int, xor_func_hash> phase_index; // index of each term in phase_expts
   vector<xor_func> outputs;   // the xors computed into each qubit
-  // TODO: make this a dependency graph instead
-  list<Hadamard>   hadamards;   // a list of the hadamards in the order we saw them
+  // The hadamards form a dependency graph: phase terms point to the hadamards
+  //   they must precede (Hadamard::in), and hadamards to the hadamards whose
+  //   values they need (Hadamard::deps). Consecutive hadamards with no edges
+  //   between them are grouped into a stage and applied together
+  vector<Hadamard> hadamards;   // the hadamards in the order we saw them
+  vector<int>      stages;      // index of the first hadamard of each stage
+  int layers_used = 0;          // partitions made by the last synthesis
+  int layers_needed = 0;        // and a lower bound on them
 
   void output(ostream& out);
   void print() {output(cout);}
   void parse_circuit(dotqc & input);
   void add_ancillae(int num);
   void remove_x();
-  dotqc synthesize();
+  int stage_end(int k) { return (k + 1 < (int)stages.size()) ? stages[k + 1] : hadamards.size(); }
+  const set<int> & stage_in(int k, set<int> & buf);
+  void stage_wires(int k, const vector<xor_func> & wires, vector<xor_func> & target);
+  int ready_after(const xor_func & f);
+  dotqc synthesize(qc_writer * out = NULL);
   dotqc synthesize_unbounded();
 };
 
@@ -89,8 +170,8 @@ enum circuit_type { CNOTT, OTHER, UNKNOWN };
 struct metacircuit {
   int n;                        // number of unknown inputs
   int m;                        // number of known inputs (initialized to |0>)
-  list<string> names;           // names of qubits
-  map<string, bool> zero;       // mapping from qubits to 0 (non-zero) or 1 (zero)
+  vector<string> names;         // names of qubits
+  vector<bool> zero;            // mapping from qubits to 0 (non-zero) or 1 (zero)
   list<pair<circuit_type, dotqc> > circuit_list;     // A list of subcircuits
 
   void partition_dotqc(dotqc & input);
@@ -99,3 +180,5 @@ struct metacircuit {
   void optimize();
   dotqc to_dotqc();
 };
+
+#endif
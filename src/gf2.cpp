@@ -0,0 +1,156 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include "gf2.h"
+
+using namespace std;
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define GF2_X86
+#endif
+
+static void xor_scalar(gf2_block * dst, const gf2_block * src, size_t n) {
+  for (size_t i = 0; i < n; i++) dst[i] ^= src[i];
+}
+
+#ifdef GF2_X86
+static_assert(sizeof(gf2_block) == 8, "x86 kernels expect 64-bit blocks");
+
+__attribute__((target("avx2")))
+static void xor_avx2(gf2_block * dst, const gf2_block * src, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(a, b));
+  }
+  for (; i < n; i++) dst[i] ^= src[i];
+}
+
+__attribute__((target("avx512f")))
+static void xor_avx512(gf2_block * dst, const gf2_block * src, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i a = _mm512_loadu_si512((const void *)(dst + i));
+    __m512i b = _mm512_loadu_si512((const void *)(src + i));
+    _mm512_storeu_si512((void *)(dst + i), _mm512_xor_si512(a, b));
+  }
+  for (; i < n; i++) dst[i] ^= src[i];
+}
+#endif
+
+static const char * kernel_name = "scalar";
+
+static void (*select_xor())(gf2_block *, const gf2_block *, size_t) {
+#ifdef GF2_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    kernel_name = "avx512";
+    return xor_avx512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    kernel_name = "avx2";
+    return xor_avx2;
+  }
+#endif
+  return xor_scalar;
+}
+
+void (*gf2_xor)(gf2_block * dst, const gf2_block * src, size_t n) = select_xor();
+
+const char * gf2_kernel_name() {
+  return kernel_name;
+}
+
+//---------------------------- Method of Four Russians
+
+int m4r_threshold = 1024;
+int m4r_inverse_threshold = 1024;
+
+// Columns per step. Building the table costs 2^k row operations, which
+//   the rows below have to make up for
+static int m4r_k(int rows, int cols) {
+  int n = min(rows, cols), k = 0;
+  while ((2 << k) <= n) k++;
+  return max(1, min(8, (3 * k) / 4));
+}
+
+int gf2_echelon_m4r(gf2_matrix & A, int cols, bool full, int k) {
+  const int bpb = gf2_matrix::bits_per_block;
+  int m = A.rows, s = A.stride, r = 0;
+  if (k <= 0) k = m4r_k(m, cols);
+
+  vector<gf2_block> table(((size_t)1 << k) * s);
+  vector<int> piv(k);
+
+  for (int c = 0; c < cols && r < m; c += k) {
+    int kk = 0, end = min(c + k, cols);
+    // Everything left of c is already zero below row r, so row operations
+    //   can start at c's block
+    int off = c / bpb, len = s - off;
+
+    // Find up to k pivots among columns c..end, keeping the pivot rows
+    //   reduced with respect to each other
+    for (int j = c; j < end && r + kk < m; j++) {
+      int i;
+      for (i = r + kk; i < m; i++) {
+        for (int p = 0; p < kk; p++) {
+          if (A.test(i, piv[p])) gf2_xor(A.row(i) + off, A.row(r + p) + off, len);
+        }
+        if (A.test(i, j)) break;
+      }
+      if (i == m) continue;
+
+      A.swap_rows(r + kk, i);
+      for (int p = 0; p < kk; p++) {
+        if (A.test(r + p, j)) gf2_xor(A.row(r + p) + off, A.row(r + kk) + off, len);
+      }
+      piv[kk++] = j;
+    }
+    if (kk == 0) continue;
+
+    // Tabulate every sum of the pivot rows, indexed by which are in it
+    fill(table.begin(), table.begin() + s, 0);
+    for (size_t x = 1; x < ((size_t)1 << kk); x++) {
+      gf2_block * dst = &table[x * s];
+      copy(&table[(x & (x - 1)) * s] + off, &table[(x & (x - 1)) * s] + s, dst + off);
+      gf2_xor(dst + off, A.row(r + __builtin_ctzl(x)) + off, len);
+    }
+
+    // Clear the pivot columns of every other row with a single lookup
+    for (int i = full ? 0 : r + kk; i < m; i++) {
+      if (i == r) {
+        i = r + kk - 1;
+        continue;
+      }
+      size_t x = 0;
+      for (int p = 0; p < kk; p++) {
+        if (A.test(i, piv[p])) x |= (size_t)1 << p;
+      }
+      if (x) gf2_xor(A.row(i) + off, &table[x * s] + off, len);
+    }
+
+    r += kk;
+  }
+
+  return r;
+}
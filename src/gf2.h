@@ -0,0 +1,97 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <climits>
+
+#ifndef GF2
+#define GF2
+
+// Word-level kernels for rows of GF(2) matrices, stored as arrays of the
+//   same blocks xor_func uses
+typedef unsigned long gf2_block;
+
+const int gf2_bits_per_block = sizeof(gf2_block) * CHAR_BIT;
+
+const size_t gf2_npos = (size_t)-1;
+
+// dst ^= src over n blocks. Points to the widest implementation the CPU
+//   supports (AVX-512, AVX2 or plain C++), chosen when the program starts
+extern void (*gf2_xor)(gf2_block * dst, const gf2_block * src, size_t n);
+
+// Name of the implementation gf2_xor points to
+const char * gf2_kernel_name();
+
+// Index of the first set bit at or after bit i of an n block row, or
+//   gf2_npos if there is none
+inline size_t gf2_scan(const gf2_block * w, size_t n, size_t i) {
+  const size_t bpb = gf2_bits_per_block;
+  size_t k = i / bpb;
+  gf2_block cur;
+
+  if (k >= n) return gf2_npos;
+  cur = w[k] & (~(gf2_block)0 << (i % bpb));
+  while (cur == 0) {
+    if (++k == n) return gf2_npos;
+    cur = w[k];
+  }
+  return k * bpb + __builtin_ctzl(cur);
+}
+
+// Dense GF(2) matrix, each row packed into stride blocks
+struct gf2_matrix {
+  static const int bits_per_block = gf2_bits_per_block;
+
+  int rows, cols, stride;
+  std::vector<gf2_block> data;
+
+  gf2_matrix(int r, int c) : rows(r), cols(c), stride((c + bits_per_block - 1) / bits_per_block),
+                             data((size_t)r * stride, 0) { }
+
+  // Reshape to a zero r x c matrix, reusing the storage
+  void resize(int r, int c) {
+    rows = r; cols = c; stride = (c + bits_per_block - 1) / bits_per_block;
+    data.assign((size_t)r * stride, 0);
+  }
+
+  gf2_block * row(int i) { return data.data() + (size_t)i * stride; }
+  const gf2_block * row(int i) const { return data.data() + (size_t)i * stride; }
+  bool test(int i, int j) const { return (row(i)[j / bits_per_block] >> (j % bits_per_block)) & 1; }
+  void swap_rows(int i, int j) { std::swap_ranges(row(i), row(i) + stride, row(j)); }
+};
+
+// Matrices with at least this many rows and columns have their rank, or
+//   are inverted, with the method of Four Russians. gf2-bench measures
+//   where the crossovers lie
+extern int m4r_threshold;
+extern int m4r_inverse_threshold;
+
+// Reduce the first cols columns of A with the method of Four Russians and
+//   return the rank. Pivot rows end up on top in order of their pivot
+//   columns and the rows below them are zero in those columns. If full is
+//   set, pivot columns are also cleared above their pivots, giving the
+//   reduced row echelon form. k is the number of columns handled per step,
+//   or 0 to pick one from the matrix size
+int gf2_echelon_m4r(gf2_matrix & A, int cols, bool full, int k = 0);
+
+#endif
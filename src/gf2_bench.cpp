@@ -0,0 +1,114 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+// Times rank and inversion of random square matrices with and without the
+//   method of Four Russians, to find where m4r_threshold and
+//   m4r_inverse_threshold should lie
+
+#include "util.h"
+#include "gf2.h"
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <chrono>
+#include <climits>
+
+using Clock = std::chrono::high_resolution_clock;
+
+// Seconds per call of f, repeating it for at least a tenth of a second
+template <typename F>
+double time_it(F f) {
+  Clock::time_point start = Clock::now();
+  double t;
+  int reps = 0;
+  do {
+    f();
+    reps++;
+    t = chrono::duration<double>(Clock::now() - start).count();
+  } while (t < 0.1);
+  return t / reps;
+}
+
+int main(int argc, char *argv[]) {
+  mt19937_64 rng(1);
+  int m4r_threshold_default = m4r_threshold;
+  int m4r_inverse_threshold_default = m4r_inverse_threshold;
+  int crossover[2] = { -1, -1 };
+
+  cout << "# Four Russians vs. Gaussian elimination (ms per call, " << gf2_kernel_name() << ")\n";
+  cout << "#    n      rank      m4r    inverse      m4r\n";
+  for (int n = 16; n <= 4096; n *= 2) {
+    vector<xor_func> bits(n), A(n);
+    double t[4];
+
+    // Only invertible matrices, so that inversion never falls back
+    do {
+      for (int i = 0; i < n; i++) {
+        bits[i] = xor_func(n + 1);
+        for (int j = 0; j < n; j++) if (rng() & 1) bits[i].set(j);
+      }
+      m4r_threshold = 0;
+    } while (compute_rank(n, n, bits) < n);
+    for (int i = 0; i < n; i++) {
+      A[i] = xor_func(n + 1);
+      for (int j = 0; j < n; j++) if (rng() & 1) A[i].set(j);
+    }
+
+    m4r_threshold = INT_MAX;
+    int r0 = compute_rank(n, n, bits);
+    t[0] = time_it([&] { compute_rank(n, n, bits); });
+    m4r_threshold = 0;
+    int r1 = compute_rank(n, n, bits);
+    t[1] = time_it([&] { compute_rank(n, n, bits); });
+    if (r0 != r1) {
+      cout << "ERROR: ranks differ (" << r0 << " vs " << r1 << ") for n = " << n << "\n";
+      exit(1);
+    }
+
+    // compose, as construct_circuit calls it, by echelon forms and by
+    //   Four Russians. Both must agree
+    vector<xor_func> e = A, f = A;
+    m4r_inverse_threshold = INT_MAX;
+    compute_compose(n, e, bits);
+    t[2] = time_it([&] { vector<xor_func> tmp = A; compute_compose(n, tmp, bits); });
+    m4r_inverse_threshold = 0;
+    compute_compose(n, f, bits);
+    t[3] = time_it([&] { vector<xor_func> tmp = A; compute_compose(n, tmp, bits); });
+    if (e != f) {
+      cout << "ERROR: inverses differ for n = " << n << "\n";
+      exit(1);
+    }
+
+    // The crossover is where Four Russians starts winning for good
+    for (int i = 0; i < 2; i++) {
+      if (t[2*i + 1] >= t[2*i]) crossover[i] = -1;
+      else if (crossover[i] == -1) crossover[i] = n;
+    }
+    cout << fixed << setprecision(3) << setw(7) << n;
+    for (int i = 0; i < 4; i++) cout << setw(10) << t[i] * 1000;
+    cout << "\n" << flush;
+  }
+  cout << "# Four Russians wins from n = " << crossover[0] << " (rank, m4r_threshold = "
+       << m4r_threshold_default << "), n = " << crossover[1] << " (inverse, m4r_inverse_threshold = "
+       << m4r_inverse_threshold_default << ")\n";
+
+  return 0;
+}
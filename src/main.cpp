@@ -19,9 +19,17 @@
 Author: Matthew Amy
 ---------------------------------------------------------------------*/
 #include "circuit.h"
+#include "pool.h"
+#include "cache.h"
+#include "gf2.h"
 #include <cstdio>
 #include <iomanip>
 #include <chrono>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <sstream>
+#include <unistd.h>
 
 using Clock = std::chrono::high_resolution_clock;
 
@@ -29,53 +37,221 @@ chrono::duration<double> elapsed(Clock::time_point start, Clock::time_point end)
   return chrono::duration_cast<chrono::duration<double> >(end - start);
 }
 
-int main(int argc, char *argv[]) {
-  Clock::time_point start, end;
-  dotqc circuit, synth;
+// Settings for one optimization job
+struct options {
   bool full_character = true;
   bool post_process = true;
   bool remove_constants = true;
+  bool stream = false;
+  bool log = false;
   int anc = 0;
-  // Quick and dirty solution, don't judge me
-  for (int i = 0; i < argc; i++)
-       if ((string)argv[i] == "-no-hadamard") full_character = false;
-  else if ((string)argv[i] == "-ancillae") {
-    i++;
-    if ((string)argv[i] == "n") anc = -1;
-    else if ((string)argv[i] == "unbounded") anc = -2;
-    else {
-      anc = atoi(argv[i]);
-      if (anc <= 0) {
-        cerr << "ERROR: less than 0 ancillae\n";
-        exit(0);
-      }
+  synth_type synth = PMH;
+  int partition = -1;           // longest augmenting path, or -1 for exact
+  double time_limit = 0;        // seconds to spend optimizing, or 0 for no limit
+  qc_format in_format = QC;
+  qc_format out_format = QC;
+  result_cache * cache = NULL;
+  thread_pool * pool = NULL;    // pool for parallel work within the job
+};
+
+// Cache key for optimizing a circuit with the given settings
+// Bump whenever a change to the optimizer or the entry format would give
+//   different results for the same key, so that stale entries are not used
+#define CACHE_VERSION 5
+
+string cache_key(const options & opt, const dotqc & circuit) {
+  hasher h;
+  h.add(CACHE_VERSION);
+  h.add(opt.full_character);
+  h.add(opt.post_process);
+  h.add(opt.remove_constants);
+  h.add(opt.anc);
+  h.add(opt.synth);
+  h.add(opt.partition);
+  h.add(circuit);
+  return h.digest();
+}
+
+const char * const synth_names[] = { "ADHOC", "GAUSS", "PMH", "BEST" };
+
+// One pass of optimization under a time limit
+struct pass {
+  int bound;              // longest augmenting path, or -1
+  synth_type synth;
+};
+
+string pass_name(const pass & p) {
+  ostringstream ret;
+  if (p.bound == -1) ret << "exact";
+  else if (p.bound == 0) ret << "greedy";
+  else ret << "bounded:" << p.bound;
+  ret << "/" << synth_names[p.synth];
+  return ret.str();
+}
+
+// Statistics of a circuit as it will be written out
+qc_stats final_stats(const options & opt, const dotqc & circ) {
+  dotqc tmp = circ;
+
+  if (opt.post_process) {
+    tmp.remove_swaps();
+    tmp.remove_ids();
+  }
+  return tmp.stats();
+}
+
+// Whether a circuit with statistics a beats one with b: less T-depth, then
+//   fewer CNOTs
+bool improves(const qc_stats & a, const qc_stats & b) {
+  return a.tdepth < b.tdepth || (a.tdepth == b.tdepth && a.cnot < b.cnot);
+}
+
+// Optimize within a time limit, running the optimization run once per pass.
+//   Greedy partitioning gives a first circuit quickly, after which longer
+//   augmenting paths are allowed, up to those of opt.partition, and then the
+//   other CNOT synthesis methods are tried. No new pass starts after the
+//   deadline, and the search of the pass running then stops growing paths.
+//   Returns the best circuit found, by T-depth and then CNOTs once
+//   post-processed, and a summary of how far it got in summary
+dotqc optimize_anytime(const options & opt, function<dotqc()> run, chrono::duration<double> spent, string & summary) {
+  const int ladder[] = { 0, 1, 4, 16 };
+  const synth_type methods[] = { PMH, GAUSS, AD_HOC, BEST };
+  vector<pass> passes;
+  dotqc ret, tmp;
+  qc_stats best(0), stats(0);
+  long wins[NUM_SYNTH_METHODS] = { 0 };   // synth_tally of the best pass
+  int i, best_pass = 0;
+  bool cut = false;
+  ostringstream out;
+
+  for (int b : ladder) {
+    if (opt.partition == -1 || b < opt.partition) passes.push_back(pass{b, opt.synth});
+  }
+  passes.push_back(pass{opt.partition, opt.synth});
+  for (synth_type s : methods) {
+    if (s != opt.synth) passes.push_back(pass{opt.partition, s});
+  }
+
+  partition_deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+      chrono::duration<double>(opt.time_limit) - spent);
+  for (i = 0; i < (int)passes.size() && (i == 0 || chrono::steady_clock::now() < partition_deadline); i++) {
+    if (disp_log) cerr << "Optimization pass " << pass_name(passes[i]) << "...\n" << flush;
+    partition_bound = passes[i].bound;
+    synth_method = passes[i].synth;
+    partition_cut = false;
+    if (synth_tally != NULL) synth_tally->clear();
+    tmp = run();
+    stats = final_stats(opt, tmp);
+    if (i == 0 || improves(stats, best)) {
+      ret = std::move(tmp);
+      best = stats;
+      best_pass = i;
+      for (int c = 0; c < NUM_SYNTH_METHODS && synth_tally != NULL; c++) wins[c] = synth_tally->wins[c];
     }
+    cut = partition_cut;
   }
-  else if ((string)argv[i] == "-no-post-process") post_process = false;
-  else if ((string)argv[i] == "-synth=ADHOC") synth_method = AD_HOC;
-  else if ((string)argv[i] == "-synth=GAUSS") synth_method = GAUSS;
-  else if ((string)argv[i] == "-synth=PMH") synth_method = PMH;
-  else if ((string)argv[i] == "-log") disp_log = true;
-  else if ((string)argv[i] == "-no-remove-constants") remove_constants = false;
+  for (int c = 0; c < NUM_SYNTH_METHODS && synth_tally != NULL; c++) synth_tally->wins[c] = wins[c];
+  partition_deadline = chrono::steady_clock::time_point::max();
+  partition_bound = opt.partition;
+  synth_method = opt.synth;
 
-  if (disp_log) cerr << "Reading circuit...\n" << flush;
-  circuit.input(cin);
-  cout << "# Original circuit\n" << flush;
-  circuit.print_stats();
-  cout << flush;
+  out << i << " of " << passes.size() << ", last " << pass_name(passes[i - 1])
+      << (cut ? " (cut short)" : "") << ", best " << pass_name(passes[best_pass]);
+  summary = out.str();
+  return ret;
+}
+
+// How often each method was kept, when BEST picked between them
+void print_wins(ostream & out, const options & opt, const synth_wins & tally) {
+  if (opt.synth != BEST) return;
+  out << "#   Synthesis wins:";
+  for (int c = 0; c < NUM_SYNTH_METHODS; c++) {
+    out << (c == 0 ? " " : ", ") << synth_names[c] << " " << tally.wins[c];
+  }
+  out << "\n" << flush;
+}
+
+// Optimize a circuit. Statistics go to info and the circuit goes to out
+void optimize(const options & opt, dotqc & circuit, ostream & info, qc_writer & out) {
+  Clock::time_point start, end;
+  dotqc synth;
+  bool stream = opt.stream;
+  result_cache * cache = opt.cache;
+  string key;
+  ostringstream report;
+  string passes;
+  synth_wins tally;
+
+  // The job's settings hold for the current thread only. Restore the old
+  //   ones after, since the thread may have been lent out by another job
+  bool old_log = disp_log;
+  synth_type old_synth = synth_method;
+  synth_wins * old_tally = synth_tally;
+  thread_pool * old_pool = job_pool;
+  int old_partition = partition_bound;
+  chrono::steady_clock::time_point old_deadline = partition_deadline;
+  bool old_cut = partition_cut;
+  disp_log = opt.log;
+  synth_method = opt.synth;
+  synth_tally = &tally;
+  job_pool = opt.pool;
+  partition_bound = opt.partition;
+  partition_deadline = chrono::steady_clock::time_point::max();
+  partition_cut = false;
+
+  // Streaming needs all qubits to be known before synthesis begins, and a
+  //   time limit may have several circuits to choose from
+  stream &= opt.full_character && opt.anc != -2 && opt.time_limit <= 0;
+
+  // A streamed circuit is written as it is built, so it can't be cached.
+  //   Neither is a result that depends on how fast the machine is
+  if (stream || opt.time_limit > 0) cache = NULL;
+  if (cache) {
+    string cached;
+    key = cache_key(opt, circuit);
+    if (cache->lookup(key, cached, synth)) {
+      if (disp_log) cerr << "Using cached result " << key << "\n" << flush;
+      info << cached << flush;
+      out.header(synth);
+      out.gates(synth);
+      out.footer();
+      out.flush();
+      disp_log = old_log;
+      synth_method = old_synth;
+      synth_tally = old_tally;
+      job_pool = old_pool;
+      partition_bound = old_partition;
+      partition_deadline = old_deadline;
+      partition_cut = old_cut;
+      return;
+    }
+  }
+
+  // Statistics of a result to be cached are collected and written out at
+  //   the end
+  ostream & rep = cache ? report : info;
+
+  rep << "# Original circuit\n" << flush;
+  circuit.print_stats(rep);
+  rep << flush;
 
   circuit.remove_ids();
-  if (full_character) {
+  if (opt.full_character) {
     character c;
     if (disp_log) cerr << "Parsing circuit...\n" << flush;
     start = Clock::now();
     c.parse_circuit(circuit);
-    if (remove_constants) c.remove_x();
-    if (anc == -1) c.add_ancillae(c.n + c.m);
-    else if (anc > 0) c.add_ancillae(anc);
+    if (opt.remove_constants) c.remove_x();
+    if (opt.anc == -1) c.add_ancillae(c.n + c.m);
+    else if (opt.anc > 0) c.add_ancillae(opt.anc);
     if (disp_log) cerr << "Resynthesizing circuit...\n" << flush;
-    if (anc == -2) synth = c.synthesize_unbounded();
-    else           synth = c.synthesize();
+    // synthesize_unbounded adds ancillae, so each of several runs works on
+    //   its own copy
+    function<dotqc()> run = [&c] { return c.synthesize(); };
+    if (opt.anc == -2) run = [&c] { character t = c; return t.synthesize_unbounded(); };
+    if (stream) synth = c.synthesize(&out);
+    else if (opt.time_limit > 0) synth = optimize_anytime(opt, run, elapsed(start, Clock::now()), passes);
+    else synth = run();
     end = Clock::now();
   } else {
     metacircuit meta;
@@ -83,21 +259,231 @@ int main(int argc, char *argv[]) {
     start = Clock::now();
     meta.partition_dotqc(circuit);
     if (disp_log) cerr << "Resynthesizing circuit...\n" << flush;
-    meta.optimize();
-    end = Clock::now();
-    synth = meta.to_dotqc();
+    if (opt.time_limit > 0) {
+      synth = optimize_anytime(opt, [&meta] {
+          metacircuit trial = meta;
+          trial.optimize();
+          return trial.to_dotqc();
+        }, elapsed(start, Clock::now()), passes);
+      end = Clock::now();
+    } else {
+      meta.optimize();
+      end = Clock::now();
+      synth = meta.to_dotqc();
+    }
+  }
+
+  if (stream) {
+    // The circuit is mostly written already, so the statistics come last
+    out.stream(synth);
+    out.footer();
+    out.flush();
+    info << "# Optimized circuit\n";
+    out.stats.print(info);
+    info << fixed << setprecision(3);
+    info << "#   Time: " << elapsed(start, end).count() << " s\n" << flush;
+    print_wins(info, opt, tally);
+  } else {
+    if (opt.post_process) {
+      if (disp_log) cerr << "Applying post-processing...\n" << flush;
+      synth.remove_swaps();
+      synth.remove_ids();
+    }
+    rep << "# Optimized circuit\n";
+    synth.print_stats(rep);
+    rep << fixed << setprecision(3);
+    rep << "#   Time: " << elapsed(start, end).count() << " s\n" << flush;
+    if (!passes.empty()) rep << "#   Passes: " << passes << "\n" << flush;
+    print_wins(rep, opt, tally);
+    if (cache) {
+      cache->store(key, report.str(), synth);
+      info << report.str() << flush;
+    }
+    out.header(synth);
+    out.gates(synth);
+    out.footer();
+    out.flush();
   }
 
-  if (post_process) {
-    if (disp_log) cerr << "Applying post-processing...\n" << flush;
-    synth.remove_swaps();
-    synth.remove_ids();
+  disp_log = old_log;
+  synth_method = old_synth;
+  synth_tally = old_tally;
+  job_pool = old_pool;
+  partition_bound = old_partition;
+  partition_deadline = old_deadline;
+  partition_cut = old_cut;
+}
+
+// Collect the circuits of a batch: every file with the input format's
+//   extension in a directory, or the files named one per line in a list
+vector<string> batch_files(const string & batch, qc_format fmt) {
+  namespace fs = std::filesystem;
+  vector<string> ret;
+  string ext = (fmt == QCB) ? ".qcb" : ".qc";
+  error_code ec;
+
+  if (fs::is_directory(batch, ec)) {
+    for (fs::directory_iterator it(batch, ec), end; !ec && it != end; it.increment(ec)) {
+      if (it->is_regular_file(ec) && it->path().extension() == ext) {
+        ret.push_back(it->path().string());
+      }
+    }
+  } else {
+    ifstream in(batch.c_str());
+    string line;
+    if (!in) {
+      cerr << "ERROR: could not open \"" << batch << "\"\n";
+      exit(1);
+    }
+    while (getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      if (!line.empty()) ret.push_back(line);
+    }
   }
-  cout << "# Optimized circuit\n";
-  synth.print_stats();
-  cout << fixed << setprecision(3);
-  cout << "#   Time: " << elapsed(start, end).count() << " s\n";
-  synth.print();
+
+  // Start on the largest circuits so that they don't end up running last
+  sort(ret.begin(), ret.end(), [](const string & a, const string & b) {
+      error_code ec;
+      uintmax_t sa = fs::file_size(a, ec), sb = fs::file_size(b, ec);
+      return sa != sb ? sa > sb : a < b;
+    });
+  return ret;
+}
+
+// Optimize every circuit of a batch concurrently. The result for a file f
+//   goes to f.opt (or f.opt.qcb), next to f or in out_dir if one is given.
+//   With binary output, the statistics go to a separate f.opt.stats. Files
+//   that can't be read or written are reported and skipped, and the number
+//   of them is returned
+int run_batch(const options & batch_opt, const string & batch, const string & out_dir, int threads) {
+  namespace fs = std::filesystem;
+  vector<string> files = batch_files(batch, batch_opt.in_format);
+  thread_pool pool(threads);
+  options opt = batch_opt;
+  atomic<int> failed(0);
+
+  // Jobs share the pool for their own parallel work
+  if (pool.size() > 1) opt.pool = &pool;
+
+  if (!out_dir.empty()) fs::create_directories(out_dir);
+  if (opt.log) cerr << "Optimizing " << files.size() << " circuits on " << pool.size() << " threads\n" << flush;
+
+  for (int i = 0; i < (int)files.size(); i++) {
+    pool.submit([&opt, &out_dir, &failed, file = files[i]] {
+        fs::path dest = out_dir.empty() ? fs::path(file) : fs::path(out_dir) / fs::path(file).filename();
+        dest += (opt.out_format == QCB) ? ".opt.qcb" : ".opt";
+
+        dotqc circuit;
+        string err;
+        if (!circuit.read(file, opt.in_format, err)) {
+          cerr << file << ": ERROR: " << err << "\n" << flush;
+          failed++;
+          return;
+        }
+
+        ofstream outf(dest.c_str(), ios::binary);
+        if (!outf) {
+          cerr << file << ": ERROR: could not write \"" << dest.string() << "\"\n" << flush;
+          failed++;
+          return;
+        }
+        qc_writer out(outf, opt.out_format);
+        if (opt.out_format == QCB) {
+          ofstream info((dest.string() + ".stats").c_str());
+          optimize(opt, circuit, info, out);
+        } else {
+          optimize(opt, circuit, outf, out);
+        }
+        if (opt.log) cerr << "Finished " << file << "\n" << flush;
+      });
+  }
+  pool.wait();
+  return failed;
+}
+
+int main(int argc, char *argv[]) {
+  options opt;
+  dotqc circuit;
+  bool convert = false;
+  int threads = 0;
+  uintmax_t cache_size = 1024;
+  string input_file, batch, out_dir, cache_dir;
+  // Quick and dirty solution, don't judge me
+  for (int i = 1; i < argc; i++)
+       if ((string)argv[i] == "-no-hadamard") opt.full_character = false;
+  else if ((string)argv[i] == "-ancillae") {
+    i++;
+    if ((string)argv[i] == "n") opt.anc = -1;
+    else if ((string)argv[i] == "unbounded") opt.anc = -2;
+    else {
+      opt.anc = atoi(argv[i]);
+      if (opt.anc <= 0) {
+        cerr << "ERROR: less than 0 ancillae\n";
+        exit(0);
+      }
+    }
+  }
+  else if ((string)argv[i] == "-no-post-process") opt.post_process = false;
+  else if ((string)argv[i] == "-synth=ADHOC") opt.synth = AD_HOC;
+  else if ((string)argv[i] == "-synth=GAUSS") opt.synth = GAUSS;
+  else if ((string)argv[i] == "-synth=PMH") opt.synth = PMH;
+  else if ((string)argv[i] == "-synth=BEST") opt.synth = BEST;
+  else if ((string)argv[i] == "-partition=exact") opt.partition = -1;
+  else if ((string)argv[i] == "-partition=greedy") opt.partition = 0;
+  else if (((string)argv[i]).compare(0, 19, "-partition=bounded:") == 0) {
+    opt.partition = atoi(argv[i] + 19);
+    if (opt.partition < 0) {
+      cerr << "ERROR: negative bound on augmenting paths\n";
+      exit(1);
+    }
+  }
+  else if (((string)argv[i]).compare(0, 12, "-time-limit=") == 0) {
+    opt.time_limit = atof(argv[i] + 12);
+    if (opt.time_limit <= 0) {
+      cerr << "ERROR: time limit must be positive\n";
+      exit(1);
+    }
+  }
+  else if ((string)argv[i] == "-log") opt.log = true;
+  else if ((string)argv[i] == "-no-remove-constants") opt.remove_constants = false;
+  else if ((string)argv[i] == "-stream") opt.stream = true;
+  else if ((string)argv[i] == "-in-format=qc") opt.in_format = QC;
+  else if ((string)argv[i] == "-in-format=qcb") opt.in_format = QCB;
+  else if ((string)argv[i] == "-out-format=qc") opt.out_format = QC;
+  else if ((string)argv[i] == "-out-format=qcb") opt.out_format = QCB;
+  else if ((string)argv[i] == "-convert") convert = true;
+  else if ((string)argv[i] == "-batch" && i + 1 < argc) batch = argv[++i];
+  else if ((string)argv[i] == "-out-dir" && i + 1 < argc) out_dir = argv[++i];
+  else if ((string)argv[i] == "-threads" && i + 1 < argc) threads = atoi(argv[++i]);
+  else if ((string)argv[i] == "-cache" && i + 1 < argc) cache_dir = argv[++i];
+  else if ((string)argv[i] == "-cache-size" && i + 1 < argc) cache_size = atoll(argv[++i]);
+  else if (argv[i][0] != '-') input_file = argv[i];
+
+  result_cache cache(cache_dir, cache_size << 20);
+  if (!cache_dir.empty()) opt.cache = &cache;
+
+  if (opt.log) cerr << "Using " << gf2_kernel_name() << " GF(2) kernels\n" << flush;
+
+  if (!batch.empty()) {
+    return run_batch(opt, batch, out_dir, threads) == 0 ? 0 : 1;
+  }
+
+  disp_log = opt.log;
+  if (disp_log) cerr << "Reading circuit...\n" << flush;
+  if (input_file.empty()) circuit.input(cin, opt.in_format);
+  else                    circuit.input(input_file, opt.in_format);
+
+  // Just translate the circuit to the output format
+  if (convert) {
+    circuit.print(opt.out_format);
+    return 0;
+  }
+
+  // Binary output leaves no room for comments, so statistics go to stderr
+  thread_pool pool(threads);
+  if (pool.size() > 1) opt.pool = &pool;
+  qc_writer out(STDOUT_FILENO, opt.out_format);
+  optimize(opt, circuit, (opt.out_format == QCB) ? cerr : cout, out);
 
   return 0;
 }
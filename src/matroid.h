@@ -20,8 +20,10 @@ Author: Matthew Amy
 ---------------------------------------------------------------------*/
 
 #include <vector>
-#include <deque>
+#include <algorithm>
 #include "partition.h"
+#include "util.h"
+#include "pool.h"
 
 #include <assert.h>
 
@@ -30,108 +32,148 @@ Author: Matthew Amy
 
 using namespace std;
 
-struct path {
-  list<pair <int, partitioning::iterator> > lst;
-
-  path() { }
-  path(int i, partitioning::iterator ref) { lst.push_front(make_pair(i, ref)); }
-  path(const path & p) { lst = p.lst; }
-  path(int i, partitioning::iterator ref, path & p) { 
-    lst = p.lst;
-    lst.push_front(make_pair(i, ref));
-  }
-
-  pair<int, partitioning::iterator> head() { return lst.front(); }
-  int                               head_elem() { return lst.front().first; }
-  partitioning::iterator            head_part() { return lst.front().second; }
-
-  path_iterator begin() { return lst.begin(); }
-  path_iterator   end() { return lst.end(); }
+//-------------------------------------- Matroids
 
-  void insert(int i, partitioning::iterator ref) { lst.push_front(make_pair(i, ref)); }
-};
+// Searches over partitions holding fewer elements than this per thread are
+//   not worth splitting up
+#define PARALLEL_SEARCH_MIN 512
 
-//-------------------------------------- Matroids
+// Test the head x of a search against the partitions lo to hi - 1 of ret.
+//   Elements x can swap with are added to found in order, if expand is set,
+//   up to the first partition that x joins, which is returned (-1 if none)
+template <class T, typename oracle_type>
+int search_block(const partitioning & ret, int lo, int hi, int x, bool expand, const vector<T> & elts,
+    const oracle_type & oracle, typename oracle_type::probe & p, vector<int> & found) {
+  int home = ret.owner_of(x);
+
+  found.clear();
+  for (int k = lo; k < hi; k++) {
+    int s = ret.slot(k);
+    if (s != home) {
+      // Check whether the partition stays independent with the head added,
+      //   or else with the head swapped for one of its elements
+      const partitioning::part & S = ret.pool[s];
+      oracle.load(p, elts, S, x);
+      if (oracle.joins(p)) return k;
+      if (!expand) continue;
+      for (int j = 0; j < (int)S.size(); j++) {
+        if (ret.seen[S[j]] != ret.stamp && oracle.swaps(p, j)) found.push_back(S[j]);
+      }
+    }
+  }
+  return -1;
+}
 
-// Implements a matroid partitioning algorithm
+// Implements a matroid partitioning algorithm. Augmenting paths are limited
+//   to partition_bound swaps, if it isn't -1, and to none past the deadline
 template <class T, typename oracle_type>
 void add_to_partition(partitioning & ret, int i, const vector<T> & elts, const oracle_type & oracle) {
-  partitioning::iterator Si;
-  set<int>::iterator yi, zi;
-
-  // The node q contains a queue of paths and an iterator to each node's location.
-  //	Each path's first element is the element we grow more paths from.
-  //	If x->y is in the path, then we can replace x with y.
-  deque<path> node_q;
-  path t;
-  path_iterator p;
-  vector<bool> marked(elts.size());
-  int tmp;
-  bool flag = false;
+  // Breadth-first search for a shortest path of swaps. Each queued element
+  //	records in parent the element that takes its place if it moves to
+  //	another partition, the root i having parent -1. The queue, parents and
+  //	marks all live in ret's workspace so that no search allocates
+  vector<int> & queue = ret.queue;
+  vector<int> & parent = ret.parent;
+  vector<unsigned> & seen = ret.seen;
+  int dest = -1, end = -1;
+  int blocks = 1, total = 0;
+  int level = 0, level_end = 1;      // search depth, and where the next begins
+  thread_pool * pool = job_pool;
 
   // Reset everything
-  node_q.clear();
-  for (int j = 0; j <= elts.size(); j++) {
-    marked[j] = false;
+  oracle.prune(ret);
+  if (seen.size() < elts.size()) {
+    seen.resize(elts.size(), 0);
+    parent.resize(elts.size());
+  }
+  if (++ret.stamp == 0) {
+    fill(seen.begin(), seen.end(), 0);
+    ret.stamp = 1;
+  }
+  queue.clear();
+
+  // The partitions stay put during the search, so their bases can be
+  //   brought up to date once here and then shared by every thread
+  for (int k = 0; k < ret.size(); k++) {
+    int s = ret.slot(k);
+    oracle.prepare(elts, ret.pool[s], ret.changed[s]);
+    ret.changed[s] = false;
+    total += ret[k].size() + 1;
+  }
+
+  // Split the partitions into blocks of about equal size, one per thread
+  if (pool != NULL) blocks = max(1, min(pool->size(), total / PARALLEL_SEARCH_MIN));
+  vector<typename oracle_type::probe> & probes = oracle.probes(blocks);
+  if ((int)ret.found.size() < blocks) ret.found.resize(blocks);
+  ret.joined.resize(blocks);
+  ret.bounds.resize(blocks + 1);
+  for (int k = 0, c = 0, acc = 0; c <= blocks; c++) {
+    while (k < ret.size() && (long)acc * blocks < (long)c * total) acc += ret[k++].size() + 1;
+    ret.bounds[c] = (c == blocks) ? ret.size() : k;
   }
 
   // Insert element to be partitioned
-  node_q.push_back(path(i, ret.end()));
-  marked[i] = true;
+  queue.push_back(i);
+  parent[i] = -1;
+  seen[i] = ret.stamp;
 
   // BFS loop
-  while (!node_q.empty() && !flag) {
+  for (int q = 0; q < (int)queue.size() && dest == -1; q++) {
     // The head of the path is what we're currently considering
-    t = node_q.front();
-    node_q.pop_front();
-
-    for (Si = ret.begin(); Si != ret.end() && !flag; Si++) {
-      if (Si != t.head_part()) {
-        // Add the head to Si. If Si is independent, leave it, otherwise we'll have to remove it
-        Si->insert(t.head_elem());
-
-        if (oracle(elts, *Si)) {
-          // We have the shortest path to a partition, so make the changes:
-          //	For each x->y in the path, remove x from its partition and add y
-          for (p = t.begin(); p != --(t.end()); ) {
-            Si = p->second;
-            (Si)->erase(p->first);
-            (Si)->insert((++p)->first);
-          }
-          flag = true;
-        } else {
-          // For each element of Si, if removing it makes an independent set, add it to the queue
-          for (yi = Si->begin(); yi != Si->end(); yi++) {
-            if (!marked[*yi]) {
-              // Generate an iterator to the position before yi
-              zi = yi;
-              if (zi != Si->begin()) zi--;
-              // Take yi out
-              tmp = *yi;
-              Si->erase(yi);
-              if (oracle(elts, *Si)) {
-                // Put yi back in
-                yi = Si->insert(Si->begin(), tmp);
-                // Add yi to the queue
-                node_q.push_back(path(*yi, Si, t));
-                marked[*yi] = true;
-              } else {
-                yi = Si->insert(Si->begin(), tmp);
-              }
-            }
-          }
-          // Remove CURRENT from Si
-          Si->erase(t.head_elem());
-        }
+    int x = queue[q];
+    if (q == level_end) {
+      level++;
+      level_end = queue.size();
+    }
+    bool expand = (partition_bound == -1 || level < partition_bound);
+    if (expand && partition_deadline != chrono::steady_clock::time_point::max()
+        && chrono::steady_clock::now() > partition_deadline) {
+      expand = false;
+      partition_cut = true;
+    }
+
+    if (blocks == 1) {
+      ret.joined[0] = search_block(ret, 0, ret.size(), x, expand, elts, oracle, probes[0], ret.found[0]);
+    } else {
+      task_group group;
+      for (int c = 1; c < blocks; c++) {
+        pool->submit([&ret, &elts, &oracle, &probes, c, x, expand] {
+            ret.joined[c] = search_block(ret, ret.bounds[c], ret.bounds[c + 1], x, expand, elts,
+                                         oracle, probes[c], ret.found[c]);
+          }, &group);
+      }
+      ret.joined[0] = search_block(ret, ret.bounds[0], ret.bounds[1], x, expand, elts, oracle, probes[0], ret.found[0]);
+      pool->wait(group);
+    }
+
+    // Merge the blocks in order, which gives the same result as testing
+    //   every partition in turn on one thread
+    for (int c = 0; c < blocks && dest == -1; c++) {
+      for (int j = 0; j < (int)ret.found[c].size(); j++) {
+        int y = ret.found[c][j];
+        queue.push_back(y);
+        parent[y] = x;
+        seen[y] = ret.stamp;
+      }
+      if (ret.joined[c] != -1) {
+        dest = ret.slot(ret.joined[c]);
+        end = x;
       }
     }
   }
 
-  // We were unsuccessful trying to edit the current partitions
-  if (!flag) {
-    set<int> newset;
-    newset.insert(i);
-    ret.push_front(newset);
+  if (dest != -1) {
+    // We have the shortest path to a partition, so make the changes:
+    //	each element on the path moves over and its parent takes its place
+    for (int cur = end; cur != -1; cur = parent[cur]) {
+      int old = ret.owner_of(cur);
+      if (old != -1) ret.erase(old, cur);
+      ret.insert(dest, cur);
+      dest = old;
+    }
+  } else {
+    // We were unsuccessful trying to edit the current partitions
+    ret.insert(ret.push_front(), i);
   }
 
 }
@@ -142,7 +184,7 @@ partitioning partition_matroid(const vector<T> & elts, const oracle_type & oracl
   partitioning ret;
 
   // For each element of the matroid
-  for (int i = 0; i < elts.size(); i++) {
+  for (int i = 0; i < (int)elts.size(); i++) {
     add_to_partition(ret, i, elts, oracle);
   }
   return ret;
@@ -152,22 +194,20 @@ partitioning partition_matroid(const vector<T> & elts, const oracle_type & oracl
 template <class T, typename oracle_type>
 void repartition(partitioning & part, const vector<T> & elts, const oracle_type & oracle) {
   int tmp;
-  partitioning::iterator Si;
-  set<int>::iterator yi;
 
-  list<int> acc;
+  vector<int> acc;
 
-  for (Si = part.begin(); Si != part.end(); Si++) {
-    tmp = oracle.retrieve_lin_dep(elts, *Si);
+  for (int k = 0; k < part.size(); k++) {
+    tmp = oracle.retrieve_lin_dep(elts, part[k]);
     if (tmp != -1) {
-      Si->erase(tmp);
+      part.erase(part.slot(k), tmp);
       acc.push_back(tmp);
     }
-    //assert(oracle(elts, *Si));
+    //assert(oracle(elts, part[k]));
   }
 
-  for (list<int>::iterator it = acc.begin(); it != acc.end(); it++) {
-    add_to_partition(part, *it, elts, oracle);
+  for (int j = 0; j < (int)acc.size(); j++) {
+    add_to_partition(part, acc[j], elts, oracle);
   }
 }
 
@@ -1,48 +1,64 @@
 /*--------------------------------------------------------------------
-  Tpar - T-gate optimization for quantum circuits
-  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
-  Institute for Quantum Computing, Quantum Circuits Group
+Tpar - T-gate optimization for quantum circuits
+Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+Institute for Quantum Computing, Quantum Circuits Group
 
-  This program is free software: you can redistribute it and/or modify
-  it under the terms of the GNU General Public License as published by
-  the Free Software Foundation, either version 3 of the License, or
-  (at your option) any later version.
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
 
-  This program is distributed in the hope that it will be useful,
-  but WITHOUT ANY WARRANTY; without even the implied warranty of
-  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-  GNU General Public License for more details.
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
 
-  You should have received a copy of the GNU General Public License
-  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 Author: Matthew Amy
 ---------------------------------------------------------------------*/
 
 #include "partition.h"
+#include <algorithm>
 
-template<typename T>
-bool is_disjoint(const set<T> & A, const set<T> & B) {
-  typename set<T>::iterator itA = A.begin(), itB = B.begin();
-
-  while (itA != A.end() && itB != B.end()) {
-    if (*itA == *itB) {
-      return false;
-    }
-    else if (*itA < *itB) itA++;
-    else itB++;
+// New empty part at the front, returning its slot
+int partitioning::push_front() {
+  int s;
+  if (unused.empty()) {
+    s = pool.size();
+    pool.push_back(part());
+    changed.push_back(true);
+  } else {
+    s = unused.back();
+    unused.pop_back();
+    changed[s] = true;
   }
+  order.push_back(s);
+  return s;
+}
 
-  return true;
+void partitioning::insert(int s, int e) {
+  part & p = pool[s];
+  p.insert(lower_bound(p.begin(), p.end(), e), e);
+  if (e >= (int)owner.size()) owner.resize(e + 1, -1);
+  owner[e] = s;
+  changed[s] = true;
+}
+
+void partitioning::erase(int s, int e) {
+  part & p = pool[s];
+  p.erase(lower_bound(p.begin(), p.end(), e));
+  owner[e] = -1;
+  changed[s] = true;
 }
 
 ostream& operator<<(ostream& output, const partitioning& part) {
-  partitioning::const_iterator Si;
-  set<int>::const_iterator yi;
+  partitioning::part::const_iterator yi;
 
-  for (Si = part.begin(); Si != part.end(); Si++) {
+  for (int k = 0; k < part.size(); k++) {
     output << "{";
-    for (yi = Si->begin(); yi != Si->end(); yi++) {
+    for (yi = part[k].begin(); yi != part[k].end(); yi++) {
       output << *yi << ",";
     }
     output << "}";
@@ -52,32 +68,52 @@ ostream& operator<<(ostream& output, const partitioning& part) {
 }
 
 // Take a partition and a set of ints, and return all partitions that are not
-//   disjoint with the set, also removing them from the partition
-partitioning freeze_partitions(partitioning & part, set<int> & st) {
+//   disjoint with the set, also removing them from the partition. Only the
+//   partitions holding elements of the set are looked at
+partitioning freeze_partitions(partitioning & part, const set<int> & st) {
   partitioning ret;
-  partitioning::iterator it, tmp;
-
-  for (it = part.begin(); it != part.end();) {
-    if (!is_disjoint(*it, st)) {
-      tmp = it;
-      it++;
-      ret.splice(ret.begin(), part, tmp);
-    } else {
-      it++;
+  partitioning::part::iterator yi;
+  vector<bool> hit(part.pool.size(), false);
+  int kept = 0, num = 0;
+
+  for (set<int>::const_iterator it = st.begin(); it != st.end(); it++) {
+    int s = part.owner_of(*it);
+    if (s != -1 && !hit[s]) {
+      hit[s] = true;
+      num++;
+    }
+  }
+  if (num == 0) return ret;
+
+  // order runs back to front, so moving matches over in this order leaves
+  //   them in ret reversed, as successive splices to the front would
+  for (int k = part.order.size() - 1; k >= 0; k--) {
+    int s = part.order[k];
+    if (hit[s]) {
+      int t = ret.push_front();
+      ret.pool[t].swap(part.pool[s]);
+      for (yi = ret.pool[t].begin(); yi != ret.pool[t].end(); yi++) {
+        part.owner[*yi] = -1;
+        if (*yi >= (int)ret.owner.size()) ret.owner.resize(*yi + 1, -1);
+        ret.owner[*yi] = t;
+      }
+      part.unused.push_back(s);
     }
   }
+
+  // Close the gaps left in the order
+  for (int k = 0; k < (int)part.order.size(); k++) {
+    if (!hit[part.order[k]]) part.order[kept++] = part.order[k];
+  }
+  part.order.resize(kept);
+
   return ret;
 }
 
-int num_elts(partitioning & part) {
+int num_elts(const partitioning & part) {
   int tot = 0;
-  partitioning::iterator it;
-  for (it = part.begin(); it != part.end(); it++) {
-    tot += it->size();
+  for (int k = 0; k < part.size(); k++) {
+    tot += part[k].size();
   }
   return tot;
 }
-
-partitioning create(set<int> & st) {
-  return partitioning(1, st);
-}
@@ -19,17 +19,55 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 Author: Matthew Amy
 ---------------------------------------------------------------------*/
 
-#include <list>
+#include <vector>
+#include <deque>
 #include <set>
 #include <iostream>
 
+#ifndef PARTITION
+#define PARTITION
+
 using namespace std;
 
-typedef list<set<int> > partitioning;
-typedef list<pair <int, partitioning::iterator> >::iterator path_iterator;
+// A partition of (some of) the elements 0, 1, ... into parts, each a sorted
+//   vector of its members. Parts live in a pool and keep their slot, and
+//   address, for as long as they exist. order lists the slots from the last
+//   part to the first, so that adding a part at the front is a push_back
+struct partitioning {
+  typedef vector<int> part;
+
+  deque<part>  pool;       // storage of the parts, including unused slots
+  vector<int>  order;      // slots of the parts, last part first
+  vector<int>  unused;     // slots free for reuse
+  vector<int>  owner;      // slot of the part holding each element, or -1
+  vector<bool> changed;    // slots changed since add_to_partition last ran
+
+  // Workspace of add_to_partition, kept between calls
+  vector<int>      parent; // element each queued element would take the place of
+  vector<int>      queue;
+  vector<unsigned> seen;   // elements with seen[e] == stamp are queued already
+  unsigned         stamp;
+  vector<int>      bounds; // first part of each block searched by one thread
+  vector<int>      joined; // part of each block joined by the head, or -1
+  vector<part>     found;  // elements of each block the head can swap with
+
+  partitioning() { stamp = 0; }
+
+  int size() const { return order.size(); }
+  bool empty() const { return order.empty(); }
+  // Slot and members of the k-th part from the front
+  int slot(int k) const { return order[order.size() - 1 - k]; }
+  const part & operator[](int k) const { return pool[slot(k)]; }
+  int owner_of(int e) const { return (e < (int)owner.size()) ? owner[e] : -1; }
+
+  int push_front();
+  void insert(int s, int e);
+  void erase(int s, int e);
+};
 
 ostream& operator<<(ostream& output, const partitioning& part);
-partitioning freeze_partitions(partitioning & part, set<int> & st);
+partitioning freeze_partitions(partitioning & part, const set<int> & st);
+
+int num_elts(const partitioning & part);
 
-int num_elts(partitioning & part);
-partitioning create(set<int> & st);
+#endif
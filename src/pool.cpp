@@ -0,0 +1,152 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include "pool.h"
+
+// Which worker of which pool the current thread is, if any
+static thread_local int worker_id = -1;
+static thread_local thread_pool * worker_pool = NULL;
+
+thread_pool::thread_pool(int threads) : queues(threads > 0 ? threads : max(1u, thread::hardware_concurrency())) {
+  queued = 0;
+  pending = 0;
+  next = 0;
+  stop = false;
+  for (int i = 0; i < (int)queues.size(); i++) {
+    workers.push_back(thread(&thread_pool::work, this, i));
+  }
+}
+
+thread_pool::~thread_pool() {
+  wait();
+  {
+    lock_guard<mutex> lk(idle_lock);
+    stop = true;
+  }
+  idle.notify_all();
+  for (int i = 0; i < (int)workers.size(); i++) workers[i].join();
+}
+
+void thread_pool::submit(function<void()> fn, task_group * group) {
+  int q = (worker_pool == this) ? worker_id : (next++ % (int)queues.size());
+
+  if (group != NULL) {
+    group->pending++;
+    group->queued++;
+  }
+  pending++;
+  {
+    lock_guard<mutex> lk(queues[q].lock);
+    queues[q].tasks.push_back(task{std::move(fn), group});
+  }
+  {
+    lock_guard<mutex> lk(idle_lock);
+    queued++;
+  }
+  idle.notify_one();
+  // A thread waiting on the group may be able to run it
+  if (group != NULL) done.notify_all();
+}
+
+// Run one task, from our own queue if possible and stolen otherwise. If
+//   only is given, just a task of that group will do
+bool thread_pool::try_run(task_group * only) {
+  int self = (worker_pool == this) ? worker_id : 0;
+  int num = queues.size();
+  task t;
+  bool found = false;
+
+  for (int i = 0; !found && i < num; i++) {
+    worker_queue & q = queues[(self + i) % num];
+    lock_guard<mutex> lk(q.lock);
+    if (only == NULL) {
+      if (q.tasks.empty()) continue;
+      if (i == 0) {
+        t = std::move(q.tasks.back());
+        q.tasks.pop_back();
+      } else {
+        t = std::move(q.tasks.front());
+        q.tasks.pop_front();
+      }
+      found = true;
+    } else if (i == 0) {
+      for (auto it = q.tasks.rbegin(); it != q.tasks.rend(); it++) {
+        if (it->group != only) continue;
+        t = std::move(*it);
+        q.tasks.erase((it + 1).base());
+        found = true;
+        break;
+      }
+    } else {
+      for (auto it = q.tasks.begin(); it != q.tasks.end(); it++) {
+        if (it->group != only) continue;
+        t = std::move(*it);
+        q.tasks.erase(it);
+        found = true;
+        break;
+      }
+    }
+  }
+  if (!found) return false;
+  queued--;
+  if (t.group != NULL) t.group->queued--;
+
+  t.fn();
+  if (t.group != NULL) t.group->pending--;
+  pending--;
+  {
+    lock_guard<mutex> lk(idle_lock);
+  }
+  done.notify_all();
+  return true;
+}
+
+void thread_pool::work(int self) {
+  worker_id = self;
+  worker_pool = this;
+  while (true) {
+    if (try_run()) continue;
+    unique_lock<mutex> lk(idle_lock);
+    idle.wait(lk, [this] { return stop || queued > 0; });
+    if (stop && queued == 0) return;
+  }
+}
+
+// Wait for a group of tasks to finish. The waiting thread runs queued
+//   tasks of the group in the meantime, so tasks can safely wait on tasks
+//   of their own. Tasks of the group already taken by other threads are
+//   running, and those only wait on groups of their own, so always finish
+void thread_pool::wait(task_group & group) {
+  while (group.pending > 0) {
+    if (try_run(&group)) continue;
+    unique_lock<mutex> lk(idle_lock);
+    done.wait(lk, [&group] { return group.pending == 0 || group.queued > 0; });
+  }
+}
+
+// Wait for every task submitted so far to finish
+void thread_pool::wait() {
+  while (pending > 0) {
+    if (try_run()) continue;
+    unique_lock<mutex> lk(idle_lock);
+    done.wait(lk, [this] { return pending == 0 || queued > 0; });
+  }
+}
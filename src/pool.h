@@ -0,0 +1,81 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#ifndef POOL
+#define POOL
+
+using namespace std;
+
+// A set of tasks that can be waited on together
+struct task_group {
+  atomic<int> pending;   // tasks in the group that have not finished
+  atomic<int> queued;    // tasks in the group that have not started
+
+  task_group() { pending = 0; queued = 0; }
+};
+
+// Work-stealing thread pool. Every worker has its own task queue, takes
+//   work from the back of it and steals from the front of the others' when
+//   it runs dry. Tasks submitted from a worker go to that worker's queue.
+//   A thread waiting on a group only helps with tasks of that group, so it
+//   is never held up by unrelated work, such as another job of a batch
+class thread_pool {
+  private:
+    struct task {
+      function<void()> fn;
+      task_group * group;
+    };
+    struct worker_queue {
+      mutex lock;
+      deque<task> tasks;
+    };
+
+    vector<thread> workers;
+    vector<worker_queue> queues;
+    mutex idle_lock;
+    condition_variable idle;     // signalled when work arrives or on shutdown
+    condition_variable done;     // signalled whenever a task finishes
+    atomic<int> queued;          // tasks waiting in some queue
+    atomic<int> pending;         // tasks submitted but not yet finished
+    atomic<int> next;            // queue for the next external submission
+    bool stop;
+
+    bool try_run(task_group * only = NULL);
+    void work(int self);
+  public:
+    thread_pool(int threads = 0);
+    ~thread_pool();
+
+    int size() const { return workers.size(); }
+    void submit(function<void()> fn, task_group * group = NULL);
+    void wait(task_group & group);
+    void wait();
+};
+
+#endif
@@ -20,11 +20,21 @@ Author: Matthew Amy
 ---------------------------------------------------------------------*/
 
 #include "util.h"
+#include "bitvec.h"
 #include <map>
+#include <algorithm>
+#include <deque>
+#include <mutex>
 #include <cmath>
+#include <cassert>
 
-bool disp_log = false;
-synth_type synth_method = PMH;
+thread_local bool disp_log = false;
+thread_local synth_type synth_method = PMH;
+thread_local synth_wins * synth_tally = NULL;
+thread_local thread_pool * job_pool = NULL;
+thread_local int partition_bound = -1;
+thread_local chrono::steady_clock::time_point partition_deadline = chrono::steady_clock::time_point::max();
+thread_local bool partition_cut = false;
 
 void print_wires(const vector<xor_func>& wires, int num, int dim) {
   int i, j;
@@ -37,72 +47,93 @@ void print_wires(const vector<xor_func>& wires, int num, int dim) {
   }
 }
 
-// Commands for making certain circuits
-gatelist xor_com(int a, int b, const vector<string>& names) {
-  list<string> tmp_list;
-  gatelist ret;
+//------------------------- Gate opcodes
 
-  tmp_list.push_back(names[a]);
-  tmp_list.push_back(names[b]);
-  ret.push_back(make_pair("tof", tmp_list));
+static const string builtin_gate_names[NUM_GATE_TYPES] =
+  { "tof", "X", "Y", "Z", "H", "P", "P*", "T", "T*" };
 
-  return ret;
-}
+// Names of the other gates seen so far, the first being opcode
+//   NUM_GATE_TYPES. Circuits may be parsed concurrently, so the table is
+//   locked. A deque never moves its elements, so names handed out stay
+//   valid as the table grows
+static deque<string> gate_names;
+static mutex gate_names_lock;
 
-gatelist swap_com(int a, int b, const vector<string>& names) {
-  list<string> tmp_list1, tmp_list2;
-  gatelist ret;
+gate_op intern_gate(string_view name) {
+  if (name == "TOF") return GATE_TOF;
+  for (int i = 0; i < NUM_GATE_TYPES; i++) {
+    if (builtin_gate_names[i] == name) return i;
+  }
 
-  tmp_list1.push_back(names[a]);
-  tmp_list1.push_back(names[b]);
-  tmp_list2.push_back(names[b]);
-  tmp_list2.push_back(names[a]);
-  ret.push_back(make_pair("tof", tmp_list1));
-  ret.push_back(make_pair("tof", tmp_list2));
-  ret.push_back(make_pair("tof", tmp_list1));
+  lock_guard<mutex> lk(gate_names_lock);
+  for (int i = 0; i < (int)gate_names.size(); i++) {
+    if (gate_names[i] == name) return NUM_GATE_TYPES + i;
+  }
+  gate_names.push_back(string(name));
+  return NUM_GATE_TYPES + gate_names.size() - 1;
+}
 
-  return ret;
+const string & gate_name(gate_op op) {
+  if (op < NUM_GATE_TYPES) return builtin_gate_names[op];
+  lock_guard<mutex> lk(gate_names_lock);
+  return gate_names[op - NUM_GATE_TYPES];
 }
 
-gatelist x_com(int a, const vector<string>& names) {
-  gatelist ret;
-  list<string> tmp_list;
+int num_gate_names() {
+  lock_guard<mutex> lk(gate_names_lock);
+  return NUM_GATE_TYPES + gate_names.size();
+}
 
-  tmp_list.push_back(names[a]);
-  ret.push_back(make_pair("tof", tmp_list));
+// Commands for making certain circuits, each added to the end of acc
+void xor_com(gatelist & acc, int a, int b) {
+  acc.push_back(gate(GATE_TOF, a, b));
+}
 
-  return ret;
+void swap_com(gatelist & acc, int a, int b) {
+  acc.push_back(gate(GATE_TOF, a, b));
+  acc.push_back(gate(GATE_TOF, b, a));
+  acc.push_back(gate(GATE_TOF, a, b));
 }
 
-gatelist om_com(int a, const vector<string>& names) {
-  gatelist ret;
-  list<string> tmp_list;
+void x_com(gatelist & acc, int a) {
+  acc.push_back(gate(GATE_TOF, a));
+}
 
-  tmp_list.push_back(names[a]);
-  ret.push_back(make_pair("H", tmp_list));
-  ret.push_back(make_pair("P", tmp_list));
-  ret.push_back(make_pair("H", tmp_list));
-  ret.push_back(make_pair("P", tmp_list));
-  ret.push_back(make_pair("H", tmp_list));
-  ret.push_back(make_pair("P", tmp_list));
+void om_com(gatelist & acc, int a) {
+  acc.push_back(gate(GATE_H, a));
+  acc.push_back(gate(GATE_P, a));
+  acc.push_back(gate(GATE_H, a));
+  acc.push_back(gate(GATE_P, a));
+  acc.push_back(gate(GATE_H, a));
+  acc.push_back(gate(GATE_P, a));
+}
 
-  return ret;
+void i_com(gatelist & acc, int a) {
+  acc.push_back(gate(GATE_TOF, a));
+  acc.push_back(gate(GATE_Z, a));
+  acc.push_back(gate(GATE_Y, a));
 }
 
-gatelist i_com(int a, const vector<string>& names) {
-  gatelist ret;
-  list<string> tmp_list;
+// Append a gate sequence to the end of a gatelist
+void append(gatelist & acc, const gatelist & lst) {
+  acc.insert(acc.end(), lst.begin(), lst.end());
+}
 
-  tmp_list.push_back(names[a]);
-  ret.push_back(make_pair("tof", tmp_list));
-  ret.push_back(make_pair("Z", tmp_list));
-  ret.push_back(make_pair("Y", tmp_list));
+//------------------------- Linear algebra
+// The routines below are templated on the row type, which is either xor_func
+//   or the narrowest fixed-width bitvec holding a row. Each entry point
+//   picks the type once and converts its rows
 
-  return ret;
-}
+// Zero row of the given width
+template <class V> inline V zero_bits(size_t n) { return V(); }
+template <> inline xor_func zero_bits<xor_func>(size_t n) { return xor_func(n, 0); }
+
+inline void load_bits(xor_func & dst, const xor_func & src) { dst = src; }
+inline void store_bits(xor_func & dst, const xor_func & src) { dst = src; }
 
 // Make triangular to determine the rank (destructive)
-int compute_rank_dest(int m, int n, vector<xor_func>& tmp) {
+template <class V>
+int rank_dest(int m, int n, vector<V>& tmp) {
   int i, j;
   int ret = 0;
 
@@ -127,34 +158,76 @@ int compute_rank_dest(int m, int n, vector<xor_func>& tmp) {
   return ret;
 }
 
-int compute_rank(int m, int n, const vector<xor_func>& bits) {
-  int ret;
-  // Make a copy of the bitset
-  vector<xor_func> tmp(m);
-  for(int i = 0; i < m; i++) {
-    tmp[i] = bits[i];
+// Rank of the first m rows over the first n columns (destructive). Unlike
+//   rank_dest, rows are reduced against a table of pivots, jumping straight
+//   between set bits, and the matrix is left in no particular form
+template <class V>
+int rank_of(int m, int n, vector<V>& rows) {
+  vector<int> pivot(n, -1);
+  int ret = 0;
+
+  for (int j = 0; j < m; j++) {
+    for (size_t i = rows[j].find_first(); i < (size_t)n; i = rows[j].find_next(i)) {
+      if (pivot[i] == -1) {
+        pivot[i] = j;
+        ret++;
+        break;
+      }
+      rows[j] ^= rows[pivot[i]];
+    }
   }
-  ret = compute_rank_dest(m, n, tmp);
+
   return ret;
 }
 
-int compute_rank(int n, const vector<exponent> & expnts, const set<int> & lst) {
-  int ret;
-  int m = lst.size();
+int compute_rank_dest(int m, int n, vector<xor_func>& bits) {
+  return dispatch_width(row_width(m, bits), [&](auto * tag) {
+      typedef remove_pointer_t<decltype(tag)> V;
+      if constexpr (is_same_v<V, xor_func>) return rank_dest(m, n, bits);
+      else {
+        vector<V> tmp(m);
+        for (int i = 0; i < m; i++) load_bits(tmp[i], bits[i]);
+        int ret = rank_dest(m, n, tmp);
+        for (int i = 0; i < m; i++) store_bits(bits[i], tmp[i]);
+        return ret;
+      }
+    });
+}
 
-  vector<xor_func> tmp(m);
-  for (int i = 0; i < m; i++) {
-    tmp[i] = expnts[i].second;
+int compute_rank(int m, int n, const vector<xor_func>& bits) {
+  if (m >= m4r_threshold && n >= m4r_threshold) {
+    gf2_matrix tmp(m, row_width(m, bits));
+    for (int i = 0; i < m; i++) pack_bits(tmp.row(i), bits[i], tmp.stride);
+    return gf2_echelon_m4r(tmp, n, false);
   }
-  ret = compute_rank_dest(m, n, tmp);
-  return ret;
+
+  return dispatch_width(row_width(m, bits), [&](auto * tag) {
+      typedef remove_pointer_t<decltype(tag)> V;
+      // Make a copy of the bitset
+      vector<V> tmp(m);
+      for (int i = 0; i < m; i++) load_bits(tmp[i], bits[i]);
+      return rank_of(m, n, tmp);
+    });
+}
+
+int compute_rank(int n, const vector<exponent> & expnts, const vector<int> & lst) {
+  int m = lst.size();
+  size_t width = 0;
+
+  for (int i = 0; i < m; i++) width = max(width, expnts[i].second.size());
+  return dispatch_width(width, [&](auto * tag) {
+      typedef remove_pointer_t<decltype(tag)> V;
+      vector<V> tmp(m);
+      for (int i = 0; i < m; i++) load_bits(tmp[i], expnts[i].second);
+      return rank_of(m, n, tmp);
+    });
 }
 
 // Check linear independence of one vector wrt a matrix (destructive)
 bool is_indep_dest(int n, const vector<xor_func>& bits, xor_func & a) {
   map<int, int> pivots;
   // Find all pivot columns
-  for (int i = 0, j = 0; i < n && j < bits.size();) {
+  for (int i = 0, j = 0; i < n && j < (int)bits.size();) {
     if (bits[j].test(i)) {
       pivots[i] = j;
       i++;
@@ -164,12 +237,10 @@ bool is_indep_dest(int n, const vector<xor_func>& bits, xor_func & a) {
     }
   }
   
-  for (int i = 0; i < n; i++) {
-    if (a.test(i)) {
-      map<int, int>::iterator it = pivots.find(i);
-      if (it == pivots.end()) return true;
-      else a ^= bits[(*it).second];
-    }
+  for (size_t i = a.find_first(); i < (size_t)n; i = a.find_next(i)) {
+    map<int, int>::iterator it = pivots.find(i);
+    if (it == pivots.end()) return true;
+    else a ^= bits[(*it).second];
   }
 
   return false;
@@ -180,15 +251,128 @@ bool is_indep(int n, const vector<xor_func>& bits, const xor_func & a) {
   return is_indep_dest(n, bits, tmp);
 }
 
-// Make echelon form
-gatelist to_upper_echelon(int m, int n, vector<xor_func>& bits, vector<xor_func>* mat, const vector<string>& names) {
-  gatelist acc;
+//------------------------- Incremental wire basis
+
+wire_basis::wire_basis(int num, int dimin, const vector<xor_func> & wires) : rows(num, dimin) {
+  const int bpb = gf2_matrix::bits_per_block;
+  dim = dimin;
+  held = -1;
+  lead = vector<int>(num, -1);
+  pivot = vector<int>(dim, -1);
+  coeff = vector<xor_func>(num);
+
+  for (int i = 0; i < num; i++) {
+    coeff[i] = xor_func(num, 0);
+    coeff[i].set(i);
+  }
+
+  // Reduce the wires one at a time against the rows so far
+  for (int i = 0; i < num; i++) {
+    for (size_t j = wires[i].find_first(); j < (size_t)dim; j = wires[i].find_next(j)) {
+      rows.row(i)[j / bpb] |= (gf2_block)1 << (j % bpb);
+    }
+    for (size_t j = gf2_scan(rows.row(i), rows.stride, 0); j != gf2_npos; j = gf2_scan(rows.row(i), rows.stride, j + 1)) {
+      if (pivot[j] != -1) add_row(i, pivot[j]);
+    }
+
+    lead[i] = gf2_scan(rows.row(i), rows.stride, 0);
+    if (lead[i] == (int)gf2_npos) {
+      lead[i] = -1;
+      continue;
+    }
+    pivot[lead[i]] = i;
+    for (int j = 0; j < i; j++) {
+      if (rows.test(j, lead[i])) add_row(j, i);
+    }
+  }
+}
+
+// Row dst += row src
+void wire_basis::add_row(int dst, int src) {
+  // Everything left of src's leading column is zero
+  int off = (lead[src] == -1) ? rows.stride : lead[src] / gf2_matrix::bits_per_block;
+
+  gf2_xor(rows.row(dst) + off, rows.row(src) + off, rows.stride - off);
+  for (int w = 0; w < (int)coeff.size(); w++) {
+    if (coeff[w].test(src)) coeff[w].flip(dst);
+  }
+}
+
+void wire_basis::cnot(int c, int t) {
+  // Writing the old wire t as the new wire t plus wire c, every row with
+  //   t as a term gains or loses c
+  coeff[c] ^= coeff[t];
+}
+
+void wire_basis::remove(int q) {
+  int r = -1;
+
+  // If wire q depends on the others, the span doesn't change. Otherwise
+  //   the row with q and the last leading column is dropped, which keeps
+  //   the remaining rows in reduced echelon form
+  for (size_t i = coeff[q].find_first(); i != xor_func::npos; i = coeff[q].find_next(i)) {
+    if (lead[i] == -1) {
+      r = i;
+      break;
+    } else if (r == -1 || lead[i] > lead[r]) {
+      r = i;
+    }
+  }
+
+  for (size_t i = coeff[q].find_first(); i != xor_func::npos; i = coeff[q].find_next(i)) {
+    if ((int)i != r) add_row(i, r);
+  }
+  if (lead[r] != -1) {
+    pivot[lead[r]] = -1;
+    lead[r] = -1;
+    fill(rows.row(r), rows.row(r) + rows.stride, 0);
+  }
+  held = r;
+}
+
+void wire_basis::assign(int q, int var) {
+  // q is a term of the held row only, so the row can be made q alone
+  for (int w = 0; w < (int)coeff.size(); w++) coeff[w].reset(held);
+  coeff[q].set(held);
+
+  fill(rows.row(held), rows.row(held) + rows.stride, 0);
+  if (var < dim) {
+    rows.row(held)[var / gf2_matrix::bits_per_block] |= (gf2_block)1 << (var % gf2_matrix::bits_per_block);
+    lead[held] = var;
+    pivot[var] = held;
+  }
+  held = -1;
+}
+
+bool wire_basis::contains(const xor_func & a) const {
+  const int bpb = gf2_matrix::bits_per_block;
+  int s = rows.stride;
+  size_t i = a.find_first();
+
+  // Most terms not in the span are caught by their first variable, so
+  //   check it before copying anything
+  if (i >= (size_t)dim) return true;
+  if (pivot[i] == -1) return false;
+
+  scratch.resize(max((size_t)s, a.num_blocks()));
+  a.to_blocks(scratch.data());
+  for (; i < (size_t)dim; i = gf2_scan(scratch.data(), s, i + 1)) {
+    if (pivot[i] == -1) return false;
+    gf2_xor(scratch.data() + i / bpb, rows.row(pivot[i]) + i / bpb, s - i / bpb);
+  }
+  return true;
+}
+
+// Make echelon form. The row operations are added as gates to the end of
+//   *acc if given, and otherwise applied to *mat
+template <class V>
+void to_upper_echelon(int m, int n, vector<V>& bits, vector<V>* mat, gatelist* acc = NULL) {
   int i, j;
   int rank = 0;
   for (j = 0; j < m; j++) {
     if (bits[j].test(n)) {
       bits[j].reset(n);
-      if (mat == NULL) acc.splice(acc.end(), x_com(j, names));
+      if (acc != NULL) x_com(*acc, j);
       else             (*mat)[j].set(m);
     }
   }
@@ -203,60 +387,57 @@ gatelist to_upper_echelon(int m, int n, vector<xor_func>& bits, vector<xor_func>
           // If it wasn't the first vector we tried, swap to the front
           if (j != rank) {
             swap(bits[rank], bits[j]);
-            if (mat == NULL) acc.splice(acc.end(), swap_com(rank, j, names));
+            if (acc != NULL) swap_com(*acc, rank, j);
             else             swap((*mat)[rank], (*mat)[j]);
           }
           flg = true;
         } else {
           bits[j] ^= bits[rank];
-          if (mat == NULL) acc.splice(acc.end(), xor_com(rank, j, names));
+          if (acc != NULL) xor_com(*acc, rank, j);
           else             (*mat)[j] ^= (*mat)[rank];
         }
       }
     }
     if (flg) rank++;
   }
-
-  return acc;
 }
 
-gatelist to_lower_echelon(int m, int n, vector<xor_func>& bits, vector<xor_func>* mat, const vector<string>& names) {
-  gatelist acc;
+template <class V>
+void to_lower_echelon(int m, int n, vector<V>& bits, vector<V>* mat, gatelist* acc = NULL) {
   int i, j;
 
   for (i = n-1; i > 0; i--) {
     for (j = i - 1; j >= 0; j--) {
       if (bits[j].test(i)) {
         bits[j] ^= bits[i];
-        if (mat == NULL) acc.splice(acc.end(), xor_com(i, j, names));
+        if (acc != NULL) xor_com(*acc, i, j);
         else              (*mat)[j] ^= (*mat)[i];
       }
     }
   }
-  return acc;
 }
 
 // Expects two matrices in echelon form, the second being a subset of the
-//   rowspace of the first. It then morphs the second matrix into the first
-gatelist fix_basis(
+//   rowspace of the first. It then morphs the second matrix into the first,
+//   recording the row operations as to_upper_echelon does
+template <class V>
+void fix_basis(
     int m,
     int n,
     int k,
-    const vector<xor_func>& fst,
-    vector<xor_func>& snd,
-    vector<xor_func>* mat,
-    const vector<string>& names )
+    const vector<V>& fst,
+    vector<V>& snd,
+    vector<V>* mat,
+    gatelist* acc = NULL)
   {
-  gatelist acc;
   int j = 0;
   bool flg = false;
-  map<int, int> pivots;  // mapping from columns to rows that have that column as pivot
-  for (int i = 0; i < n; i++) pivots[i] = -1;
+  vector<int> pivots(n, -1);  // mapping from columns to rows that have that column as pivot
 
   // First pass makes sure tmp has the same pivots as fst
   for (int i = 0; i < m; i++) {
     // Find the next pivot
-    while (j < n && !fst[i].test(j)) j++;
+    if (j < n && !fst[i].test(j)) j = min((size_t)n, fst[i].find_next(j));
     if (j < n) {
       pivots[j] = i;
       flg = false;
@@ -266,7 +447,7 @@ gatelist fix_basis(
           flg = true;
           if (h != i) {
             swap(snd[h], snd[i]);
-            if (mat == NULL) acc.splice(acc.end(), swap_com(h, i, names));
+            if (acc != NULL) swap_com(*acc, h, i);
             else             swap((*mat)[h], (*mat)[i]);
           }
         }
@@ -280,8 +461,8 @@ gatelist fix_basis(
         snd[k] = fst[i];
         if (k != i) {
           swap(snd[k], snd[i]);
-          if (mat == NULL) {
-            acc.splice(acc.end(), swap_com(k, i, names));
+          if (acc != NULL) {
+            swap_com(*acc, k, i);
           } else {
             swap((*mat)[k], (*mat)[i]);
           }
@@ -291,18 +472,21 @@ gatelist fix_basis(
     }
   }
 
-  // Second pass makes each row of tmp equal to that row of fst
+  // Second pass makes each row of tmp equal to that row of fst. Adding the
+  //   row with pivot j only changes columns j and up, so the columns still
+  //   to fix can be found by scanning the difference
   for (int i = 0; i < m; i++) {
-    for (int j = i +1; j < n; j++) {
-      if (fst[i][j] != snd[i][j]) {
-        if (pivots[j] == -1) {
-          cout << "FATAL ERROR: cannot fix basis\n" << flush;
-          exit(1);
-        } else {
-          snd[i] ^= snd[pivots[j]];
-          if (mat == NULL) acc.splice(acc.end(), xor_com(pivots[j], i, names));
-          else             (*mat)[i] ^= (*mat)[pivots[j]];
-        }
+    V diff = fst[i];
+    diff ^= snd[i];
+    for (size_t j = diff.find_next(i); j < (size_t)n; j = diff.find_next(j)) {
+      if (pivots[j] == -1) {
+        cout << "FATAL ERROR: cannot fix basis\n" << flush;
+        exit(1);
+      } else {
+        snd[i] ^= snd[pivots[j]];
+        diff ^= snd[pivots[j]];
+        if (acc != NULL) xor_com(*acc, pivots[j], i);
+        else             (*mat)[i] ^= (*mat)[pivots[j]];
       }
     }
     if (!(snd[i] == fst[i])) {
@@ -310,30 +494,75 @@ gatelist fix_basis(
       exit(1);
     }
   }
+}
 
-  return acc;
+// A := B^{-1} A by reducing [B | A] with the method of Four Russians.
+//   Returns false, leaving A as it was, if B is singular
+template <class V>
+bool compose_m4r(int num, vector<V>& A, const vector<V>& B) {
+  const int bpb = gf2_matrix::bits_per_block;
+  const gf2_block bit = (gf2_block)1 << (num % bpb);
+  int w = (num + bpb) / bpb;
+  gf2_matrix M(num, 2 * w * bpb);
+
+  for (int i = 0; i < num; i++) {
+    pack_bits(M.row(i), B[i], w);
+    pack_bits(M.row(i) + w, A[i], w);
+    // Constants of B move into A, as in to_upper_echelon
+    if (M.test(i, num)) {
+      M.row(i)[num / bpb] ^= bit;
+      M.row(i)[w + num / bpb] |= bit;
+    }
+  }
+  if (gf2_echelon_m4r(M, num, true) < num) return false;
+
+  for (int i = 0; i < num; i++) {
+    unpack_bits(A[i], M.row(i) + w, w);
+  }
+  return true;
 }
 
 // A := B^{-1} A
-void compose(int num, vector<xor_func>& A, const vector<xor_func>& B) {
-  auto tmp = vector<xor_func>(num);
+template <class V>
+void compose(int num, vector<V>& A, const vector<V>& B) {
+  if (num >= m4r_inverse_threshold && compose_m4r(num, A, B)) return;
+
+  auto tmp = vector<V>(num);
   for (int i = 0; i < num; i++) {
     tmp[i] = B[i];
   }
-  to_upper_echelon(num, num, tmp, &A, vector<string>());
-  to_lower_echelon(num, num, tmp, &A, vector<string>());
+  to_upper_echelon(num, num, tmp, &A);
+  to_lower_echelon(num, num, tmp, &A);
+}
+
+void compute_compose(int num, vector<xor_func>& A, const vector<xor_func>& B) {
+  dispatch_width(max(row_width(num, A), row_width(num, B)), [&](auto * tag) {
+      typedef remove_pointer_t<decltype(tag)> V;
+      if constexpr (is_same_v<V, xor_func>) compose(num, A, B);
+      else {
+        vector<V> a(num), b(num);
+        for (int i = 0; i < num; i++) {
+          load_bits(a[i], A[i]);
+          load_bits(b[i], B[i]);
+        }
+        compose(num, a, b);
+        for (int i = 0; i < num; i++) store_bits(A[i], a[i]);
+      }
+    });
 }
 
 //------------------------- CNOT synthesis methods
 
 // Gaussian elimination based CNOT synthesis
-gatelist gauss_CNOT_synth(int n, int m, vector<xor_func>& bits, const vector<string>& names) {
-  gatelist lst;
+//   Gates are generated in reverse order on the end of acc and flipped there
+template <class V>
+void gauss_CNOT_synth(int n, int m, vector<V>& bits, gatelist & acc) {
+  size_t start = acc.size();
 
   for (int j = 0; j < n; j++) {
     if (bits[j].test(n)) {
       bits[j].reset(n);
-      lst.splice(lst.begin(), x_com(j, names));
+      x_com(acc, j);
     }
   }
 
@@ -347,12 +576,12 @@ gatelist gauss_CNOT_synth(int n, int m, vector<xor_func>& bits, const vector<str
           // If it wasn't the first vector we tried, swap to the front
           if (j != i) {
             swap(bits[i], bits[j]);
-            lst.splice(lst.begin(), swap_com(i, j, names));
+            swap_com(acc, i, j);
           }
           flg = true;
         } else {
           bits[j] ^= bits[i];
-          lst.splice(lst.begin(), xor_com(i, j, names));
+          xor_com(acc, i, j);
         }
       }
     }
@@ -367,17 +596,19 @@ gatelist gauss_CNOT_synth(int n, int m, vector<xor_func>& bits, const vector<str
     for (int j = i - 1; j >= 0; j--) {
       if (bits[j].test(i)) {
         bits[j] ^= bits[i];
-        lst.splice(lst.begin(), xor_com(i, j, names));
+        xor_com(acc, i, j);
       }
     }
   }
-
-  return lst;
+  reverse(acc.begin() + start, acc.end());
 }
 
 // Patel/Markov/Hayes CNOT synthesis
-gatelist Lwr_CNOT_synth(int n, int m, vector<xor_func>& bits, const vector<string>& names, bool rev) {
-  gatelist acc;
+//   If rev is set the gates are generated in reverse order on the end of acc
+//   and flipped there
+template <class V>
+void Lwr_CNOT_synth(int n, int m, vector<V>& bits, bool rev, gatelist & acc) {
+  size_t start = acc.size();
   int sec, tmp, row, col, i;
   vector<int> patt(1<<m);
 
@@ -395,8 +626,8 @@ gatelist Lwr_CNOT_synth(int n, int m, vector<xor_func>& bits, const vector<strin
         patt[tmp] = row;
       } else if (tmp != 0) {
         bits[row] ^= bits[patt[tmp]];
-        if (rev) acc.splice(acc.begin(), xor_com(row, patt[tmp], names));
-        else acc.splice(acc.end(), xor_com(patt[tmp], row, names));
+        if (rev) xor_com(acc, row, patt[tmp]);
+        else xor_com(acc, patt[tmp], row);
       }
     }
 
@@ -408,83 +639,89 @@ gatelist Lwr_CNOT_synth(int n, int m, vector<xor_func>& bits, const vector<strin
             bits[row] ^= bits[col];
             bits[col] ^= bits[row];
             if (rev) {
-              acc.splice(acc.begin(), xor_com(col, row, names));
-              acc.splice(acc.begin(), xor_com(row, col, names));
-              acc.splice(acc.begin(), xor_com(col, row, names));
+              xor_com(acc, col, row);
+              xor_com(acc, row, col);
+              xor_com(acc, col, row);
             } else {
-              acc.splice(acc.end(), xor_com(row, col, names));
-              acc.splice(acc.end(), xor_com(col, row, names));
-              acc.splice(acc.end(), xor_com(row, col, names));
+              xor_com(acc, row, col);
+              xor_com(acc, col, row);
+              xor_com(acc, row, col);
             }
           } else {
             bits[row] ^= bits[col];
-            if (rev) acc.splice(acc.begin(), xor_com(row, col, names));
-            else acc.splice(acc.end(), xor_com(col, row, names));
+            if (rev) xor_com(acc, row, col);
+            else xor_com(acc, col, row);
           }
         }
       }
     }
   }
-
-  return acc;
+  if (rev) reverse(acc.begin() + start, acc.end());
 }
 
-gatelist CNOT_synth(int n, vector<xor_func>& bits, const vector<string>& names) {
-  gatelist acc;
+template <class V>
+void CNOT_synth(int n, vector<V>& bits, gatelist & acc) {
+  size_t start = acc.size(), xs;
   int i, j, m = (int)(log((double)n) / (log(2) * 2));
   // When m <= 1, PMH is just Gaussian elimination, so default to it
-  if (m <= 1) return gauss_CNOT_synth(n, 0, bits, names);
+  if (m <= 1) {
+    gauss_CNOT_synth(n, 0, bits, acc);
+    return;
+  }
 
+  // The X gates come last, so are moved past the rest once it's done
   for (j = 0; j < n; j++) {
     if (bits[j].test(n)) {
       bits[j].reset(n);
-      acc.splice(acc.begin(), x_com(j, names));
+      x_com(acc, j);
     }
   }
+  xs = acc.size();
 
-  acc.splice(acc.end(), Lwr_CNOT_synth(n, m, bits, names, false));
+  Lwr_CNOT_synth(n, m, bits, false, acc);
   for (i = 0; i < n; i++) {
     for (j = i + 1; j < n; j++) {
-      bits[j][i] = bits[i][j];
+      bits[j].set(i, bits[i].test(j));
       bits[i].reset(j);
     }
   }
-  acc.splice(acc.end(), Lwr_CNOT_synth(n, m, bits, names, true));
-  acc.reverse();
-
-  return acc;
+  Lwr_CNOT_synth(n, m, bits, true, acc);
+  reverse(acc.begin() + xs, acc.end());
+  rotate(acc.begin() + start, acc.begin() + xs, acc.end());
 }
 
-gatelist global_phase_synth(int n, int phase, const vector<string>& names) {
+gatelist global_phase_synth(int n, int phase) {
   gatelist acc;
   int qubit = 0;
 
   if (phase % 2 == 1) {
-    acc.splice(acc.end(), om_com(qubit, names));
+    om_com(acc, qubit);
     qubit = (qubit + 1) % n;
   }
   for (int i = phase / 2; i > 0; i--) {
-    acc.splice(acc.end(), i_com(qubit, names));
+    i_com(acc, qubit);
     qubit = (qubit + 1) % n;
   }
 
   return acc;
 }
 
-// Construct a circuit for a given partition
+// Construct a circuit for a given partition. Every step adds its gates
+//   straight to the end of the result
+template <class V>
 gatelist construct_circuit(
     const vector<exponent> & phase,
     const partitioning & part,
-    vector<xor_func>& in,
-    const vector<xor_func>& out,
+    vector<V>& in,
+    const vector<V>& out,
     int num,
-    int dim,
-    const vector<string>& names) {
-  gatelist ret, tmp, rev;
-  auto bits = vector<xor_func>(num);
-  auto pre = vector<xor_func>(num);
-  auto post = vector<xor_func>(num);
-  set<int>::iterator ti;
+    int dim) {
+  gatelist ret;
+  size_t start = 0, end = 0;
+  auto bits = vector<V>(num);
+  auto pre = vector<V>(num);
+  auto post = vector<V>(num);
+  vector<int>::const_iterator ti;
   int i;
   bool flg = true;
 
@@ -494,8 +731,8 @@ gatelist construct_circuit(
   for (int i = 0; i < num; i++) {
     flg &= (in[i] == out[i]);
     if (synth_method != AD_HOC) {
-      pre[i] = xor_func(num + 1, 0);
-      post[i] = xor_func(num + 1, 0);
+      pre[i] = zero_bits<V>(num + 1);
+      post[i] = zero_bits<V>(num + 1);
       pre[i].set(i);
       post[i].set(i);
     }
@@ -504,60 +741,59 @@ gatelist construct_circuit(
 
   // Reduce in to echelon form to decide on a basis
   if (synth_method == AD_HOC) {
-    ret.splice(ret.end(), to_upper_echelon(num, dim, in, NULL, names));
+    to_upper_echelon<V>(num, dim, in, NULL, &ret);
   } else {
-    to_upper_echelon(num, dim, in, &pre, vector<string>());
+    to_upper_echelon<V>(num, dim, in, &pre);
   }
 
   // For each partition... Compute *it, apply T gates, uncompute
-  for (partitioning::const_iterator it = part.begin(); it != part.end(); it++) {
+  for (int k = 0; k < part.size(); k++) {
+    const partitioning::part * it = &part[k];
     for (ti = it->begin(), i = 0; i < num; i++) {
-      if (i < it->size()) {
-        bits[i] = phase[*ti].second;
+      if (i < (int)it->size()) {
+        load_bits(bits[i], phase[*ti].second);
         ti++;
       } else {
-        bits[i] = xor_func(dim + 1, 0);
+        bits[i] = zero_bits<V>(dim + 1);
       }
     }
 
     // prepare the bits
     if (synth_method == AD_HOC) {
-      tmp = to_upper_echelon(it->size(), dim, bits, NULL, names);
-      tmp.splice(tmp.end(), fix_basis(num, dim, it->size(), in, bits, NULL, names));
-      rev = tmp;
-      rev.reverse();
-      ret.splice(ret.end(), rev);
+      start = ret.size();
+      to_upper_echelon<V>(it->size(), dim, bits, NULL, &ret);
+      fix_basis<V>(num, dim, it->size(), in, bits, NULL, &ret);
+      end = ret.size();
+      reverse(ret.begin() + start, ret.end());
     } else {
-      to_upper_echelon(it->size(), dim, bits, &post, vector<string>());
-      fix_basis(num, dim, it->size(), in, bits, &post, vector<string>());
+      to_upper_echelon<V>(it->size(), dim, bits, &post);
+      fix_basis<V>(num, dim, it->size(), in, bits, &post);
       compose(num, pre, post);
-      if (synth_method == GAUSS) ret.splice(ret.end(), gauss_CNOT_synth(num, 0, pre, names));
-      else if (synth_method == PMH) ret.splice(ret.end(), CNOT_synth(num, pre, names));
+      if (synth_method == GAUSS) gauss_CNOT_synth(num, 0, pre, ret);
+      else if (synth_method == PMH) CNOT_synth(num, pre, ret);
     }
 
     // apply the T gates
-    list<string> tmp_lst;
     for (ti = it->begin(), i = 0; ti != it->end(); ti++, i++) {
-      tmp_lst.clear();
-      tmp_lst.push_back(names[i]);
       if (phase[*ti].first <= 4) {
-        if (phase[*ti].first / 4 == 1) ret.push_back(make_pair("Z", tmp_lst));
-        if (phase[*ti].first / 2 == 1) ret.push_back(make_pair("P", tmp_lst));
-        if (phase[*ti].first % 2 == 1) ret.push_back(make_pair("T", tmp_lst));
+        if (phase[*ti].first / 4 == 1) ret.push_back(gate(GATE_Z, i));
+        if (phase[*ti].first / 2 == 1) ret.push_back(gate(GATE_P, i));
+        if (phase[*ti].first % 2 == 1) ret.push_back(gate(GATE_T, i));
       } else {
-        if (phase[*ti].first == 5 || phase[*ti].first == 6) ret.push_back(make_pair("P*", tmp_lst));
-        if (phase[*ti].first % 2 == 1) ret.push_back(make_pair("T*", tmp_lst));
+        if (phase[*ti].first == 5 || phase[*ti].first == 6) ret.push_back(gate(GATE_PDAG, i));
+        if (phase[*ti].first % 2 == 1) ret.push_back(gate(GATE_TDAG, i));
       }
     }
 
-    // unprepare the bits
-    if (synth_method == AD_HOC) ret.splice(ret.end(), tmp);
-    else {
+    // unprepare the bits, replaying the preparation backwards
+    if (synth_method == AD_HOC) {
+      for (size_t g = end; g > start; g--) ret.push_back(ret[g - 1]);
+    } else {
       pre = std::move(post);
-      post = vector<xor_func>(num);
+      post = vector<V>(num);
       // re-initialize
       for (i = 0; i < num; i++) {
-        post[i] = xor_func(num + 1, 0);
+        post[i] = zero_bits<V>(num + 1);
         post[i].set(i);
       }
     }
@@ -568,72 +804,107 @@ gatelist construct_circuit(
     bits[i] = out[i];
   }
   if (synth_method == AD_HOC) {
-    tmp = to_upper_echelon(num, dim, bits, NULL, names);
-    tmp.splice(tmp.end(), fix_basis(num, dim, num, in, bits, NULL, names));
-    tmp.reverse();
-    ret.splice(ret.end(), tmp);
+    start = ret.size();
+    to_upper_echelon<V>(num, dim, bits, NULL, &ret);
+    fix_basis<V>(num, dim, num, in, bits, NULL, &ret);
+    reverse(ret.begin() + start, ret.end());
   } else {
-    to_upper_echelon(num, dim, bits, &post, vector<string>());
-    fix_basis(num, dim, num, in, bits, &post, vector<string>());
+    to_upper_echelon<V>(num, dim, bits, &post);
+    fix_basis<V>(num, dim, num, in, bits, &post);
     compose(num, pre, post);
-    if (synth_method == GAUSS) ret.splice(ret.end(), gauss_CNOT_synth(num, 0, pre, names));
-    else if (synth_method == PMH) ret.splice(ret.end(), CNOT_synth(num, pre, names));
+    if (synth_method == GAUSS) gauss_CNOT_synth(num, 0, pre, ret);
+    else if (synth_method == PMH) CNOT_synth(num, pre, ret);
   }
   return ret;
 }
 
-// Matroid oracle
-bool ind_oracle::operator()(const vector<exponent> & expnts, const set<int> & lst) const {
-  if (lst.size() > num) return false;
-  if (lst.size() == 1 || (num - lst.size()) >= dim) return true;
+gatelist construct_circuit(
+    const vector<exponent> & phase,
+    const partitioning & part,
+    vector<xor_func>& in,
+    const vector<xor_func>& out,
+    int num,
+    int dim) {
+  size_t width = max(row_width(num, in), row_width(num, out));
+
+  return dispatch_width(max(width, (size_t)num + 1), [&](auto * tag) {
+      typedef remove_pointer_t<decltype(tag)> V;
+      if constexpr (is_same_v<V, xor_func>) return construct_circuit<V>(phase, part, in, out, num, dim);
+      else {
+        vector<V> vin(num), vout(num);
+        gatelist ret;
+        for (int i = 0; i < num; i++) load_bits(vin[i], in[i]);
+        // in and out are often the same wires, in which case the echelon
+        //   form of in is also what out is reduced from
+        if (&in == &out) {
+          ret = construct_circuit<V>(phase, part, vin, vin, num, dim);
+        } else {
+          for (int i = 0; i < num; i++) load_bits(vout[i], out[i]);
+          ret = construct_circuit<V>(phase, part, vin, vout, num, dim);
+        }
+        for (int i = 0; i < num; i++) store_bits(in[i], vin[i]);
+        return ret;
+      }
+    });
+}
+
+// Width of the widest exponent in lst
+static size_t expnt_width(const vector<exponent> & expnts, const vector<int> & lst) {
+  size_t ret = 0;
+  for (vector<int>::const_iterator it = lst.begin(); it != lst.end(); it++) {
+    ret = max(ret, expnts[*it].second.size());
+  }
+  return ret;
+}
 
-  set<int>::const_iterator it;
-  int i, j, rank = 0;
-  auto tmp = vector<xor_func>(lst.size());
+// Rank of the exponents in lst
+template <class V>
+static int oracle_rank(const vector<exponent> & expnts, const vector<int> & lst, int length) {
+  vector<int>::const_iterator it;
+  int i;
+  auto tmp = vector<V>(lst.size());
 
   for (i = 0, it = lst.begin(); it != lst.end(); it++, i++) {
-    tmp[i] = expnts[*it].second;
+    load_bits(tmp[i], expnts[*it].second);
   }
 
-  for (i = 0; i < length; i++) {
-    bool flg = false;
-    for (j = rank; j < lst.size(); j++) {
-      if (tmp[j].test(i)) {
-        // If we haven't yet seen a vector with bit i set...
-        if (!flg) {
-          // If it wasn't the first vector we tried, swap to the front
-          if (j != rank) swap(tmp[rank], tmp[j]);
-          flg = true;
-        } else {
-          tmp[j] ^= tmp[rank];
-        }
-      }
-    }
-    if (flg) rank++;
-  }
+  return rank_of(lst.size(), length, tmp);
+}
 
-  return (num - lst.size()) >= (dim - rank);
+// Matroid oracle
+bool ind_oracle::operator()(const vector<exponent> & expnts, const vector<int> & lst) const {
+  if ((int)lst.size() > num) return false;
+  if (lst.size() == 1 || (num - (int)lst.size()) >= dim) return true;
+
+  int rank = dispatch_width(expnt_width(expnts, lst), [&](auto * tag) {
+      return oracle_rank<remove_pointer_t<decltype(tag)> >(expnts, lst, length);
+    });
+
+  return (num - (int)lst.size()) >= (dim - rank);
 }
 
-// Shortcut to find a linearly dependent element faster
-int ind_oracle::retrieve_lin_dep(const vector<exponent> & expnts, const set<int> & lst) const {
-  set<int>::const_iterator it;
-  int i, j, rank = 0, tmpr;
+// Find a linearly dependent element of lst, returning -1 and the rank of lst
+//   in rank if there is none
+template <class V>
+static int lin_dep(const vector<exponent> & expnts, const vector<int> & lst, int length, int & rank) {
+  vector<int>::const_iterator it;
+  int i, j, tmpr;
   map<int, int> mp;
-  auto tmp = vector<xor_func>(lst.size());
+  auto tmp = vector<V>(lst.size());
 
+  rank = 0;
   for (i = 0, it = lst.begin(); it != lst.end(); it++, i++) {
-    tmp[i] = expnts[*it].second;
+    load_bits(tmp[i], expnts[*it].second);
     mp[i] = *it;
   }
 
-  for (j = 0; j < lst.size(); j++) {
+  for (j = 0; j < (int)lst.size(); j++) {
     if (tmp[j].test(length)) tmp[j].reset(length);
   }
 
   for (i = 0; i < length; i++) {
     bool flg = false;
-    for (j = rank; j < lst.size(); j++) {
+    for (j = rank; j < (int)lst.size(); j++) {
       if (tmp[j].test(i)) {
         // If we haven't yet seen a vector with bit i set...
         if (!flg) {
@@ -654,6 +925,148 @@ int ind_oracle::retrieve_lin_dep(const vector<exponent> & expnts, const set<int>
     if (flg) rank++;
   }
 
-  assert((num - lst.size()) >= (dim - rank));
   return -1;
 }
+
+// Shortcut to find a linearly dependent element faster
+int ind_oracle::retrieve_lin_dep(const vector<exponent> & expnts, const vector<int> & lst) const {
+  int rank, ret;
+
+  ret = dispatch_width(expnt_width(expnts, lst), [&](auto * tag) {
+      return lin_dep<remove_pointer_t<decltype(tag)> >(expnts, lst, length, rank);
+    });
+
+  assert(ret != -1 || (num - (int)lst.size()) >= (dim - rank));
+  return ret;
+}
+
+// Load the first length columns of f into row, clearing the rest of its
+//   stride blocks
+void ind_oracle::load_row(vector<gf2_block> & row, const xor_func & f, int stride, int tw) const {
+  const int bpb = gf2_matrix::bits_per_block;
+
+  row.assign(max((size_t)stride, f.num_blocks()), 0);
+  f.to_blocks(row.data());
+  fill(row.begin() + tw, row.end(), 0);
+  if (length % bpb != 0) row[tw - 1] &= ((gf2_block)1 << (length % bpb)) - 1;
+}
+
+// Reduce row against the basis b, leaving the elements it is the sum of
+//   after the columns. Returns whether it reduced to zero, i.e. lies in the
+//   span of the partition
+bool ind_oracle::reduce(vector<gf2_block> & row, const part_basis & b) const {
+  const int bpb = gf2_matrix::bits_per_block;
+  int tw = (length + bpb - 1) / bpb;
+
+  for (size_t i = gf2_scan(row.data(), tw, 0); i < (size_t)length; i = gf2_scan(row.data(), tw, i + 1)) {
+    if (b.pivot[i] == -1) return false;
+    const gf2_block * src = b.rows.row(b.pivot[i]);
+    if (b.rows.stride >= 8) gf2_xor(row.data(), src, b.rows.stride);
+    else for (int k = 0; k < b.rows.stride; k++) row[k] ^= src[k];
+  }
+  return true;
+}
+
+// Cached basis of lst, rebuilt if lst changed since it was computed
+const ind_oracle::part_basis & ind_oracle::basis(const vector<exponent> & expnts, const vector<int> & lst) const {
+  const int bpb = gf2_matrix::bits_per_block;
+  int tw = (length + bpb - 1) / bpb;
+  part_basis & b = cache[&lst];
+  vector<gf2_block> & row = scratch;
+
+  if (b.elts.size() == lst.size() && equal(b.elts.begin(), b.elts.end(), lst.begin())) return b;
+
+  int s = lst.size();
+  b.elts.assign(lst.begin(), lst.end());
+  b.rows.resize(s, tw * bpb + s);
+  b.pivot.assign(length, -1);
+  b.rank = 0;
+  b.circ.assign((s + bpb - 1) / bpb, 0);
+  b.memo.assign(expnts.size(), -1);
+  b.answers.clear();
+  for (int j = 0; j < s; j++) {
+    load_row(row, expnts[b.elts[j]].second, b.rows.stride, tw);
+    row[tw + j / bpb] |= (gf2_block)1 << (j % bpb);
+    if (reduce(row, b)) {
+      // Dependent: every element it was reduced with lies on a circuit
+      for (size_t k = 0; k < b.circ.size(); k++) b.circ[k] |= row[tw + k];
+    } else {
+      size_t i = gf2_scan(row.data(), tw, 0);
+      copy(row.begin(), row.begin() + b.rows.stride, b.rows.row(b.rank));
+      b.pivot[i] = b.rank++;
+    }
+  }
+  return b;
+}
+
+void ind_oracle::load(probe & p, const vector<exponent> & expnts, const vector<int> & lst, int x) const {
+  const int bpb = gf2_matrix::bits_per_block;
+  int tw = (length + bpb - 1) / bpb;
+  auto it = cache.find(&lst);
+
+  assert(it != cache.end() && it->second.elts.size() == lst.size());
+  // Only the thread searching lst touches its basis, so may add to it
+  part_basis & b = it->second;
+  p.cur = &b;
+  if (x < (int)b.memo.size() && b.memo[x] != -1) {
+    p.hits++;
+    p.fits = b.answers[b.memo[x]];
+    p.mask = b.answers.data() + b.memo[x] + 1;
+    return;
+  }
+
+  p.misses++;
+  load_row(p.row, expnts[x].second, b.rows.stride, tw);
+  p.spans = reduce(p.row, b);
+
+  // Work out every swap at once. Taking out an element on no circuit lowers
+  //   the rank, unless x is in the span and its sum uses that element
+  int s = lst.size(), r = b.rank;
+  gf2_block on_circ = indep(s, r + !p.spans) ? ~(gf2_block)0 : 0;
+  gf2_block used = indep(s, r - !p.spans) ? ~(gf2_block)0 : 0;
+  gf2_block unused = indep(s, r - p.spans) ? ~(gf2_block)0 : 0;
+  int at = b.answers.size();
+  p.fits = indep(s + 1, r + !p.spans);
+  b.answers.push_back(p.fits);
+  for (int k = 0; k < (s + bpb - 1) / bpb; k++) {
+    gf2_block circ = b.circ[k];
+    gf2_block sum = p.spans ? p.row[tw + k] : 0;
+    gf2_block m = (circ & on_circ) | (~circ & sum & used) | (~circ & ~sum & unused);
+    if (k == s / bpb) m &= ((gf2_block)1 << (s % bpb)) - 1;
+    b.answers.push_back(m);
+  }
+  if (x >= (int)b.memo.size()) b.memo.resize(x + 1, -1);
+  b.memo[x] = at;
+  p.mask = b.answers.data() + at + 1;
+}
+
+void ind_oracle::set_dim(int newdim) {
+  dim = newdim;
+  for (auto & it : cache) {
+    fill(it.second.memo.begin(), it.second.memo.end(), -1);
+    it.second.answers.clear();
+  }
+}
+
+long ind_oracle::memo_hits() const {
+  long ret = 0;
+  for (const probe & p : spare) ret += p.hits;
+  return ret;
+}
+
+long ind_oracle::memo_misses() const {
+  long ret = 0;
+  for (const probe & p : spare) ret += p.misses;
+  return ret;
+}
+
+void ind_oracle::prune(const partitioning & part) const {
+  if ((int)cache.size() <= 2 * part.size() + 64) return;
+
+  unordered_map<const partitioning::part *, part_basis> keep;
+  for (int k = 0; k < part.size(); k++) {
+    auto ti = cache.find(&part[k]);
+    if (ti != cache.end()) keep.emplace(ti->first, std::move(ti->second));
+  }
+  cache.swap(keep);
+}
@@ -20,45 +20,213 @@ Author: Matthew Amy
 ---------------------------------------------------------------------*/
 
 #include <vector>
-#include <boost/dynamic_bitset.hpp>
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <chrono>
+#include <atomic>
+#include <unordered_map>
 #include "partition.h"
+#include "gf2.h"
+#include "xorfunc.h"
+
+#ifndef UTIL
+#define UTIL
 
-typedef boost::dynamic_bitset<>            xor_func;
 typedef pair<char, xor_func >              exponent;
-typedef list<pair<string, list<string> > > gatelist;
 
-enum synth_type { AD_HOC, GAUSS, PMH };
+// Hash of an xor_func, mixing every block so that functions differing in a
+//   single variable land in different buckets
+struct xor_func_hash {
+  size_t operator()(const xor_func & f) const { return f.hash(); }
+};
+
+// Gate opcodes. Gates outside the recognized set are interned by name at
+//   parse time and receive opcodes starting from NUM_GATE_TYPES
+typedef unsigned short gate_op;
+enum gate_type { GATE_TOF, GATE_X, GATE_Y, GATE_Z, GATE_H, GATE_P, GATE_PDAG,
+                 GATE_T, GATE_TDAG, NUM_GATE_TYPES };
+
+#define MAX_GATE_ARITY 4
+
+// A gate is an opcode together with the indices of the qubits it acts on.
+//   Qubit indices refer to the name table of the enclosing circuit. Gates on
+//   more than MAX_GATE_ARITY qubits keep them in the circuit's operand store
+//   instead, with args[0] the offset of the first one there
+struct gate {
+  gate_op        type;
+  unsigned short arity;
+  int            args[MAX_GATE_ARITY];
+
+  gate() { type = GATE_TOF; arity = 0; args[0] = args[1] = args[2] = args[3] = 0; }
+  gate(gate_op t, int a) : gate() { type = t; arity = 1; args[0] = a; }
+  gate(gate_op t, int a, int b) : gate() { type = t; arity = 2; args[0] = a; args[1] = b; }
+  gate(gate_op t, int a, int b, int c) : gate() { type = t; arity = 3; args[0] = a; args[1] = b; args[2] = c; }
+
+  bool wide() const { return arity > MAX_GATE_ARITY; }
+};
+
+typedef vector<gate> gatelist;
+
+gate_op intern_gate(string_view name);
+const string & gate_name(gate_op op);
+int num_gate_names();
+void append(gatelist & acc, const gatelist & lst);
+
+// BEST synthesizes each {CNOT, T} subcircuit with the other methods and
+//   keeps the one with the fewest CNOTs
+enum synth_type { AD_HOC, GAUSS, PMH, BEST };
+#define NUM_SYNTH_METHODS 3
+
+// Number of subcircuits for which each method was kept by BEST
+struct synth_wins {
+  atomic<long> wins[NUM_SYNTH_METHODS];
+
+  synth_wins() { clear(); }
+  void clear() { for (int i = 0; i < NUM_SYNTH_METHODS; i++) wins[i] = 0; }
+};
+
+class thread_pool;
 
-extern bool disp_log;
-extern synth_type synth_method;
+// Settings of the job running on the current thread
+extern thread_local bool disp_log;
+extern thread_local synth_type synth_method;
+extern thread_local synth_wins * synth_tally;  // where BEST counts its picks, or NULL
+extern thread_local thread_pool * job_pool;    // pool for parallel work, or NULL
+extern thread_local int partition_bound;       // longest augmenting path, or -1
+// Searches for augmenting paths past the deadline go no further than the
+//   partitions already there, and set partition_cut
+extern thread_local chrono::steady_clock::time_point partition_deadline;
+extern thread_local bool partition_cut;
 
 class ind_oracle {
   private: 
     int num;
     int dim;
     int length;
+
+    // Echelon basis of a partition, kept until the partition changes. Each
+    //   row is followed by the set of elements it is the sum of
+    struct part_basis {
+      vector<int> elts;          // elements of the partition, in order
+      gf2_matrix rows;
+      vector<int> pivot;         // row leading with each column, or -1
+      int rank;
+      vector<gf2_block> circ;    // elements lying on some circuit
+      // Answers of earlier loads: for each element, the offset in answers
+      //   of whether it joins followed by its swap mask, or -1
+      vector<int> memo;
+      vector<gf2_block> answers;
+
+      part_basis() : rows(0, 0) { rank = 0; }
+    };
+  public:
+    // State of one incremental test. Threads testing at the same time each
+    //   need their own
+    struct probe {
+      const part_basis * cur;    // partition of the last load
+      bool spans;                // whether it spans the loaded element
+      bool fits;                 // whether the loaded element joins
+      const gf2_block * mask;    // positions of the elements it swaps with
+      vector<gf2_block> row;     // the loaded element, reduced
+      long hits, misses;         // loads answered from memory or not
+
+      probe() { cur = NULL; spans = fits = false; mask = NULL; hits = misses = 0; }
+    };
+  private:
+    mutable unordered_map<const partitioning::part *, part_basis> cache;
+    mutable vector<gf2_block> scratch;    // row being added by basis
+    mutable vector<probe> spare;          // probes handed out by probes()
+
+    const part_basis & basis(const vector<exponent> & expnts, const vector<int> & lst) const;
+    void load_row(vector<gf2_block> & row, const xor_func & f, int stride, int tw) const;
+    bool reduce(vector<gf2_block> & row, const part_basis & b) const;
+    bool indep(int size, int rank) const {
+      if (size > num) return false;
+      if (size == 1 || (num - size) >= dim) return true;
+      return (num - size) >= (dim - rank);
+    }
   public:
     ind_oracle() { num = 0; dim = 0; length = 0; }
     ind_oracle(int numin, int dimin, int lengthin) { num = numin; dim = dimin; length = lengthin; }
 
-    void set_dim(int newdim) { dim = newdim; }
-    int retrieve_lin_dep(const vector<exponent> & expnts, const set<int> & lst) const;
+    // Answers of earlier loads depend on the dimension, so are dropped
+    void set_dim(int newdim);
+    int retrieve_lin_dep(const vector<exponent> & expnts, const vector<int> & lst) const;
+
+    bool operator()(const vector<exponent> & expnts, const vector<int> & lst) const;
 
-    bool operator()(const vector<exponent> & expnts, const set<int> & lst) const;
+    // Incremental tests of a partition lst against an element x not in it.
+    //   prepare brings the cached basis of lst up to date, load then reduces
+    //   x against it, after which joins tells whether lst + x is independent
+    //   and swaps(j) whether lst + x - lst[j] is. Loads of different
+    //   partitions may run concurrently, but not alongside prepare or prune.
+    //   Unless lst may have changed, prepare only builds a basis that isn't
+    //   cached yet. The answers for each x are kept with the basis, so loads
+    //   repeated by later searches skip the reduction
+    void prepare(const vector<exponent> & expnts, const vector<int> & lst, bool changed) const {
+      if (changed || cache.find(&lst) == cache.end()) basis(expnts, lst);
+    }
+    void load(probe & p, const vector<exponent> & expnts, const vector<int> & lst, int x) const;
+    bool joins(const probe & p) const { return p.fits; }
+    bool swaps(const probe & p, int j) const {
+      return (p.mask[j / gf2_matrix::bits_per_block] >> (j % gf2_matrix::bits_per_block)) & 1;
+    }
+    // Number of loads answered from memory, and worked out
+    long memo_hits() const;
+    long memo_misses() const;
+    // At least n probes, kept between calls
+    vector<probe> & probes(int n) const {
+      if ((int)spare.size() < n) spare.resize(n);
+      return spare;
+    }
+    // Drop cached bases of partitions no longer in part
+    void prune(const partitioning & part) const;
+};
+
+// Reduced echelon basis for the span of a set of wires over the first dim
+//   variables, kept up to date as gates are applied so that membership can
+//   be tested without a fresh elimination. Each row also records which wires
+//   it is the sum of; rows that sum to zero record dependencies between wires
+class wire_basis {
+  private:
+    int dim;
+    gf2_matrix       rows;    // row values
+    vector<int>      lead;    // leading column of each row, or -1 if zero
+    vector<int>      pivot;   // row leading with each column, or -1
+    vector<xor_func> coeff;   // for each wire, the rows it is a term of
+    int held;                 // row set aside by remove, or -1
+    mutable vector<gf2_block> scratch;
+
+    void add_row(int dst, int src);
+  public:
+    wire_basis() : rows(0, 0) { dim = 0; held = -1; }
+    wire_basis(int num, int dimin, const vector<xor_func> & wires);
+
+    // wire t ^= wire c
+    void cnot(int c, int t);
+    // Take wire q out of the span, until it is assigned a new value
+    void remove(int q);
+    // Give the removed wire q the value of a fresh variable
+    void assign(int q, int var);
+    bool contains(const xor_func & a) const;
 };
 
 void print_wires(const vector<xor_func>& wires, int num, int dim);
 int compute_rank_dest(int m, int n, vector<xor_func>& bits);
 int compute_rank(int m, int n, const vector<xor_func>& bits);
-int compute_rank(int n, const vector<exponent> & expnts, const set<int> & lst);
+int compute_rank(int n, const vector<exponent> & expnts, const vector<int> & lst);
 bool is_indep(int n, const vector<xor_func>& bits, const xor_func & a);
+// A := B^{-1} A, for B of full rank
+void compute_compose(int num, vector<xor_func>& A, const vector<xor_func>& B);
 
-gatelist global_phase_synth(int n, int phase, const vector<string>& names);
+gatelist global_phase_synth(int n, int phase);
 
 gatelist construct_circuit(const vector<exponent> & phase, 
     const partitioning & part, 
     vector<xor_func>& in,
     const vector<xor_func>& out,
     int num,
-    int dim,
-    const vector<string>& names);
+    int dim);
+
+#endif
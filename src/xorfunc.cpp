@@ -0,0 +1,177 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include "xorfunc.h"
+
+xor_func::xor_func(size_t n, unsigned long val) : nbits(n), sparse(n >= sparse_min) {
+  if (!sparse) {
+    blk.assign(num_blocks(), 0);
+    if (n > 0) blk[0] = (n < (size_t)bits_per_block) ? val & (((block_type)1 << n) - 1) : val;
+  } else {
+    for (size_t i = 0; val != 0; i++, val >>= 1) {
+      if (val & 1) idx.push_back(i);
+    }
+  }
+}
+
+void xor_func::densify() {
+  blk.assign(num_blocks(), 0);
+  for (size_t i = 0; i < idx.size(); i++) {
+    blk[idx[i] / bits_per_block] |= (block_type)1 << (idx[i] % bits_per_block);
+  }
+  vector<uint32_t>().swap(idx);
+  sparse = false;
+}
+
+void xor_func::make_sparse() {
+  idx.clear();
+  for (size_t i = find_first(); i != npos; i = find_next(i)) idx.push_back(i);
+  vector<block_type>().swap(blk);
+  sparse = true;
+}
+
+xor_func & xor_func::reset() {
+  if (nbits >= sparse_min) {
+    idx.clear();
+    vector<block_type>().swap(blk);
+    sparse = true;
+  } else {
+    fill(blk.begin(), blk.end(), 0);
+  }
+  return *this;
+}
+
+bool xor_func::none() const {
+  if (sparse) return idx.empty();
+  for (size_t i = 0; i < blk.size(); i++) if (blk[i] != 0) return false;
+  return true;
+}
+
+size_t xor_func::count() const {
+  size_t ret = 0;
+  if (sparse) return idx.size();
+  for (size_t i = 0; i < blk.size(); i++) ret += __builtin_popcountl(blk[i]);
+  return ret;
+}
+
+xor_func & xor_func::operator^=(const xor_func & b) {
+  if (!sparse && !b.sparse) {
+    if (blk.size() >= 8) gf2_xor(blk.data(), b.blk.data(), blk.size());
+    else for (size_t i = 0; i < blk.size(); i++) blk[i] ^= b.blk[i];
+  } else if (!sparse) {
+    for (size_t i = 0; i < b.idx.size(); i++) {
+      blk[b.idx[i] / bits_per_block] ^= (block_type)1 << (b.idx[i] % bits_per_block);
+    }
+  } else if (!b.sparse) {
+    blk = b.blk;
+    for (size_t i = 0; i < idx.size(); i++) {
+      blk[idx[i] / bits_per_block] ^= (block_type)1 << (idx[i] % bits_per_block);
+    }
+    vector<uint32_t>().swap(idx);
+    sparse = false;
+  } else {
+    vector<uint32_t> tmp;
+    tmp.reserve(idx.size() + b.idx.size());
+    set_symmetric_difference(idx.begin(), idx.end(), b.idx.begin(), b.idx.end(), back_inserter(tmp));
+    idx.swap(tmp);
+    if (idx.size() > sparse_max()) densify();
+  }
+  return *this;
+}
+
+xor_func & xor_func::operator|=(const xor_func & b) {
+  if (b.sparse) {
+    for (size_t i = 0; i < b.idx.size(); i++) set(b.idx[i]);
+  } else {
+    if (sparse) densify();
+    for (size_t i = 0; i < blk.size(); i++) blk[i] |= b.blk[i];
+  }
+  return *this;
+}
+
+bool xor_func::is_subset_of(const xor_func & b) const {
+  if (!sparse && !b.sparse) {
+    for (size_t i = 0; i < blk.size(); i++) if (blk[i] & ~b.blk[i]) return false;
+    return true;
+  }
+  for (size_t i = find_first(); i != npos; i = find_next(i)) {
+    if (!b.test(i)) return false;
+  }
+  return true;
+}
+
+bool xor_func::operator==(const xor_func & b) const {
+  if (nbits != b.nbits) return false;
+  if (sparse == b.sparse) return sparse ? idx == b.idx : blk == b.blk;
+  const xor_func & s = sparse ? *this : b;
+  const xor_func & d = sparse ? b : *this;
+  return d.count() == s.idx.size() && s.is_subset_of(d);
+}
+
+size_t xor_func::hash() const {
+  uint64_t h = nbits * 0x9e3779b97f4a7c15ULL;
+  size_t i = 0;
+
+  // Mix in the non-zero blocks with their positions, building them from
+  //   the variable list when sparse
+  while (true) {
+    size_t k;
+    block_type b = 0;
+    if (sparse) {
+      if (i == idx.size()) break;
+      k = idx[i] / bits_per_block;
+      for (; i < idx.size() && idx[i] / bits_per_block == k; i++) {
+        b |= (block_type)1 << (idx[i] % bits_per_block);
+      }
+    } else {
+      for (; i < blk.size() && blk[i] == 0; i++);
+      if (i == blk.size()) break;
+      k = i;
+      b = blk[i++];
+    }
+    h = (h ^ b ^ (k << 32)) * 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 31;
+  }
+  return h;
+}
+
+void xor_func::to_blocks(block_type * dst) const {
+  if (!sparse) {
+    copy(blk.begin(), blk.end(), dst);
+    return;
+  }
+  fill(dst, dst + num_blocks(), 0);
+  for (size_t i = 0; i < idx.size(); i++) {
+    dst[idx[i] / bits_per_block] |= (block_type)1 << (idx[i] % bits_per_block);
+  }
+}
+
+void xor_func::from_blocks(const block_type * src) {
+  vector<uint32_t>().swap(idx);
+  sparse = false;
+  blk.assign(src, src + num_blocks());
+  if (nbits >= sparse_min && count() < sparse_low()) make_sparse();
+}
+
+ostream & operator<<(ostream & out, const xor_func & f) {
+  for (size_t i = f.size(); i > 0; i--) out << (f.test(i - 1) ? '1' : '0');
+  return out;
+}
@@ -0,0 +1,128 @@
+/*--------------------------------------------------------------------
+  Tpar - T-gate optimization for quantum circuits
+  Copyright (C) 2013  Matthew Amy and The University of Waterloo,
+  Institute for Quantum Computing, Quantum Circuits Group
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+Author: Matthew Amy
+---------------------------------------------------------------------*/
+
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <algorithm>
+#include "gf2.h"
+
+#ifndef XORFUNC
+#define XORFUNC
+
+using namespace std;
+
+// Linear boolean function of size() variables, i.e. a vector over GF(2).
+//   Most terms and wires of a Hadamard-heavy circuit involve only a handful
+//   of its variables, so wide functions keep the sorted list of the
+//   variables they contain rather than one bit per variable. A list that
+//   would take more room than the bits is turned into bits
+class xor_func {
+  public:
+    typedef gf2_block block_type;
+    static const int bits_per_block = gf2_bits_per_block;
+    static const size_t npos = gf2_npos;
+    static const size_t sparse_min = 256;  // narrower functions are always dense
+
+  private:
+    size_t nbits;
+    bool sparse;
+    vector<uint32_t>   idx;   // variables in increasing order, if sparse
+    vector<block_type> blk;   // one bit per variable, if dense
+
+    // Most variables a sparse function may hold, and the count below which
+    //   a function read back from blocks is made sparse
+    size_t sparse_max() const { return nbits / 32; }
+    size_t sparse_low() const { return nbits / 64; }
+    void densify();
+    void make_sparse();
+  public:
+    xor_func() : nbits(0), sparse(false) { }
+    explicit xor_func(size_t n, unsigned long val = 0);
+
+    size_t size() const { return nbits; }
+    size_t num_blocks() const { return (nbits + bits_per_block - 1) / bits_per_block; }
+    bool is_sparse() const { return sparse; }
+
+    bool test(size_t i) const {
+      if (!sparse) return (blk[i / bits_per_block] >> (i % bits_per_block)) & 1;
+      return binary_search(idx.begin(), idx.end(), (uint32_t)i);
+    }
+    xor_func & set(size_t i) {
+      if (!sparse) blk[i / bits_per_block] |= (block_type)1 << (i % bits_per_block);
+      else {
+        vector<uint32_t>::iterator it = lower_bound(idx.begin(), idx.end(), (uint32_t)i);
+        if (it == idx.end() || *it != i) {
+          idx.insert(it, i);
+          if (idx.size() > sparse_max()) densify();
+        }
+      }
+      return *this;
+    }
+    xor_func & reset(size_t i) {
+      if (!sparse) blk[i / bits_per_block] &= ~((block_type)1 << (i % bits_per_block));
+      else {
+        vector<uint32_t>::iterator it = lower_bound(idx.begin(), idx.end(), (uint32_t)i);
+        if (it != idx.end() && *it == i) idx.erase(it);
+      }
+      return *this;
+    }
+    xor_func & flip(size_t i) { return test(i) ? reset(i) : set(i); }
+    xor_func & set(size_t i, bool val) { return val ? set(i) : reset(i); }
+    xor_func & reset();
+
+    bool none() const;
+    bool any() const { return !none(); }
+    size_t count() const;
+    size_t find_first() const {
+      if (!sparse) return gf2_scan(blk.data(), blk.size(), 0);
+      return idx.empty() ? npos : idx.front();
+    }
+    size_t find_next(size_t i) const {
+      if (!sparse) return gf2_scan(blk.data(), blk.size(), i + 1);
+      vector<uint32_t>::const_iterator it = upper_bound(idx.begin(), idx.end(), (uint32_t)i);
+      return it == idx.end() ? npos : *it;
+    }
+
+    xor_func & operator^=(const xor_func & b);
+    xor_func & operator|=(const xor_func & b);
+    bool is_subset_of(const xor_func & b) const;
+    bool operator==(const xor_func & b) const;
+    bool operator!=(const xor_func & b) const { return !(*this == b); }
+
+    // Depends only on the value, not on how it is stored
+    size_t hash() const;
+
+    // Copy out to, or in from, num_blocks() blocks
+    void to_blocks(block_type * dst) const;
+    void from_blocks(const block_type * src);
+};
+
+inline xor_func operator^(const xor_func & a, const xor_func & b) {
+  xor_func ret = a;
+  ret ^= b;
+  return ret;
+}
+
+// Prints the bits from the highest variable down
+ostream & operator<<(ostream & out, const xor_func & f);
+
+#endif